@@ -0,0 +1,158 @@
+/**
+ * @file sber_bench.c
+ * @brief Сравнение пропускной способности механизмов хранения очереди sber_dev.
+ *
+ * Для каждого механизма хранения (список сегментов, кольцевой буфер и шарды) и каждого
+ * размера операции (1, 64 и 1000 байт) один поток пишет в устройство, а другой
+ * читает из него через один и тот же дескриптор, пока не будет передан заданный
+ * объем данных. Очередь дескриптора должна быть пустой, чтобы драйвер разрешил
+ * сменить механизм хранения; удобнее всего запускать утилиту в параллельном режиме
+ * (ioctl 2), где у дескриптора своя очередь.
+ *
+ * Сборка: make bench
+ * Запуск: ./sber_bench [устройство] [объем_в_байтах]
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sber_driver.h"
+
+#define DEFAULT_DEVICE "/dev/sber_dev"
+#define DEFAULT_TOTAL (16UL << 20)
+
+// Параметры одного прогона: дескриптор, размер операции и общий объем передачи.
+struct bench_run {
+    int fd;
+    size_t op_size;
+    size_t total;
+};
+
+static double now_sec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *writer_thread(void *arg) {
+    struct bench_run *run = arg;
+    char buf[1000];
+    size_t done = 0;
+    ssize_t ret;
+
+    memset(buf, 0xa5, sizeof(buf));
+    while (done < run->total) {
+        ret = write(run->fd, buf, run->op_size);
+        if (ret < 0) {
+            if (errno == ENOSPC || errno == EAGAIN) {
+                sched_yield();
+                continue;
+            }
+            perror("write");
+            return (void *)1;
+        }
+        done += ret;
+    }
+    return NULL;
+}
+
+static void *reader_thread(void *arg) {
+    struct bench_run *run = arg;
+    char buf[1000];
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < run->total) {
+        ret = read(run->fd, buf, run->op_size);
+        if (ret < 0) {
+            if (errno == EAGAIN) {
+                sched_yield();
+                continue;
+            }
+            perror("read");
+            return (void *)1;
+        }
+        if (ret == 0) {
+            sched_yield();
+            continue;
+        }
+        done += ret;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Выполняет один прогон и печатает пропускную способность.
+ *
+ * @return 0 при успехе, -1 при ошибке ввода-вывода.
+ */
+static int bench(const char *name, int fd, size_t op_size, size_t total) {
+    struct bench_run run = { .fd = fd, .op_size = op_size, .total = total - total % op_size };
+    pthread_t writer, reader;
+    void *wret, *rret;
+    double start, elapsed;
+
+    start = now_sec();
+    pthread_create(&reader, NULL, reader_thread, &run);
+    pthread_create(&writer, NULL, writer_thread, &run);
+    pthread_join(writer, &wret);
+    pthread_join(reader, &rret);
+    elapsed = now_sec() - start;
+
+    if (wret || rret) {
+        return -1;
+    }
+
+    printf("%-5s %5zu B/op  %10.0f ops/s  %9.2f MB/s\n", name, op_size,
+           run.total / op_size / elapsed, run.total / elapsed / (1 << 20));
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    static const size_t sizes[] = { 1, 64, 1000 };
+    static const struct {
+        const char *name;
+        __u32 engine;
+    } engines[] = {
+        { "list", SBER_ENGINE_LIST },
+        { "ring", SBER_ENGINE_RING },
+        { "shard", SBER_ENGINE_SHARD },
+    };
+    const char *device = argc > 1 ? argv[1] : DEFAULT_DEVICE;
+    size_t total = argc > 2 ? strtoul(argv[2], NULL, 0) : DEFAULT_TOTAL;
+    size_t e, i;
+    int fd;
+    int ret = 0;
+
+    fd = open(device, O_RDWR);
+    if (fd < 0) {
+        perror(device);
+        return 1;
+    }
+
+    for (e = 0; e < sizeof(engines) / sizeof(engines[0]) && !ret; e++) {
+        if (ioctl(fd, SBER_IOC_SET_ENGINE, &engines[e].engine)) {
+            perror("SBER_IOC_SET_ENGINE");
+            ret = 1;
+            break;
+        }
+        for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            // Побайтовые операции на порядки медленнее, поэтому для них объем уменьшается.
+            if (bench(engines[e].name, fd, sizes[i], sizes[i] == 1 ? total / 64 : total)) {
+                ret = 1;
+                break;
+            }
+        }
+    }
+
+    close(fd);
+    return ret;
+}
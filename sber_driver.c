@@ -8,283 +8,4267 @@
 #include <linux/rwsem.h>
 #include <linux/list.h>
 #include <linux/device.h>
+#include <linux/kfifo.h>
+#include <linux/log2.h>
+#include <linux/moduleparam.h>
+#include <linux/sizes.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/huge_mm.h>
+#include <linux/pfn_t.h>
+#include <linux/uio.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/sched/signal.h>
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/percpu_counter.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/rcupdate.h>
+#include <linux/rculist.h>
+#include <linux/hashtable.h>
+#include <linux/stringhash.h>
+#include <linux/refcount.h>
+#include <linux/shrinker.h>
+#include <linux/topology.h>
+#include <linux/nodemask.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "sber_driver.h"
+
+#define CREATE_TRACE_POINTS
+#include "sber_trace.h"
 
 #define DEVICE_NAME "sber_dev"
 #define QUEUE_SIZE 1000
+#define QUEUE_MAX_CAPACITY SZ_1G
 #define DEFAULT_MODE 0
 #define SINGLE_OPEN_MODE 1
 #define MULTI_OPEN_MODE 2
+// Бит в queue_minor.flags: экземпляр открыт в одиночном режиме.
+#define MINOR_SINGLE_OPEN 0
+#define MAX_DEVICES 256
+// Таблица именованных очередей содержит 2^NAMED_QUEUE_HASH_BITS корзин.
+#define NAMED_QUEUE_HASH_BITS 8
+// Сколько байт свободных сегментов опустевшая очередь держит в пуле по умолчанию.
+#define POOL_CACHE_DEFAULT SZ_16K
 
 
 static dev_t first;
-static int device_mode = DEFAULT_MODE;
 static struct class *queue_class;
 static struct cdev c_dev;
-static DEFINE_MUTEX(single_open_lock);
 
-// Представляет элемент очереди, содержащий однобайтовый data и указатели для реализации списка (struct list_head).
-struct queue_element {
-    struct list_head list;
-    char data;
-};
+static unsigned int nr_devices = 1;
+module_param(nr_devices, uint, 0444);
+MODULE_PARM_DESC(nr_devices, "Number of independent queue devices /dev/sber_dev0..N-1 (default 1: /dev/sber_dev)");
+
+static unsigned long queue_capacity = QUEUE_SIZE;
+module_param(queue_capacity, ulong, 0444);
+MODULE_PARM_DESC(queue_capacity, "Default queue capacity in bytes (default 1000, runtime: /sys/class/sber_dev/capacity)");
+
+static unsigned long queue_pool_cache = POOL_CACHE_DEFAULT;
+module_param(queue_pool_cache, ulong, 0644);
+MODULE_PARM_DESC(queue_pool_cache, "Bytes of free chunks a new queue keeps cached until memory pressure (default 16384)");
+
+static unsigned int chunk_size;
+module_param(chunk_size, uint, 0444);
+MODULE_PARM_DESC(chunk_size, "Payload size of a storage chunk in bytes (default: one page per chunk)");
+
+static int verbosity = 2;
+module_param(verbosity, int, 0644);
+MODULE_PARM_DESC(verbosity, "Logging verbosity: 0 - errors, 1 - warnings, 2 - queue and mode changes "
+                            "(per-operation events are tracepoints in events/sber)");
+
+// Сообщения, которые выводятся в зависимости от параметра verbosity. Ошибки выводятся всегда.
+// Чтение, запись, открытие и закрытие не пишут в журнал ядра, а вызывают точки трассировки из sber_trace.h.
+#define sber_warn(fmt, ...) do { if (READ_ONCE(verbosity) >= 1) pr_warn(fmt, ##__VA_ARGS__); } while (0)
+#define sber_info(fmt, ...) do { if (READ_ONCE(verbosity) >= 2) pr_info(fmt, ##__VA_ARGS__); } while (0)
+
+// Представляет элемент очереди (сегмент): непрерывный участок байтов data размером chunk_size,
+// из которого читаются байты начиная со смещения head и в который дописываются байты по смещению tail.
+// head меняет только читатель, tail - только писатель, который публикует его через smp_store_release.
+struct queue_chunk {
+    struct list_head list;
+    size_t head;
+    size_t tail;
+    char data[];
+};
+
+// Размер полезной области сегмента по умолчанию: сегмент вместе с заголовком занимает ровно одну страницу.
+#define CHUNK_DEFAULT_SIZE (PAGE_SIZE - sizeof(struct queue_chunk))
+#define CHUNK_MIN_SIZE 64
+#define CHUNK_MAX_SIZE SZ_64K
+// Максимальное количество сегментов, выделяемых или освобождаемых одним пакетным вызовом.
+#define CHUNK_BATCH 16
+// Операции не больше этого размера используют промежуточный буфер на стеке, а не в куче.
+#define STAGE_ONSTACK 256
+// Максимальное количество байт, возвращаемое одним вызовом read.
+#define STAGE_READ_MAX SZ_1M
+// Максимальный размер промежуточного буфера записи: больший поток ставится в очередь частями.
+#define STAGE_WRITE_MAX SZ_1M
+
+// Пакет сегментов для kmem_cache_alloc_bulk/kmem_cache_free_bulk.
+struct chunk_batch {
+    void *chunks[CHUNK_BATCH];
+    size_t nr;
+};
+
+// Запись очереди в режиме SBER_FRAMING_RECORD: данные одного вызова write длиной len.
+// Записью также хранятся данные, извлеченные SBER_IOC_READ_PENDING до подтверждения: owner -
+// дескриптор, который их извлек, token - идентификатор подтверждения (0, пока он не выдан).
+struct queue_record {
+    struct list_head list;
+    size_t len;
+    struct file *owner;
+    u64 token;
+    char data[];
+};
+
+// Шард очереди SBER_ENGINE_SHARD: данные, записанные на одном процессоре, под собственной спин-блокировкой.
+struct queue_shard {
+    spinlock_t lock;
+    struct list_head nodes;
+};
+
+// Элемент шарда: данные одного вызова write длиной len, из которых уже прочитано head байт.
+struct shard_node {
+    struct list_head list;
+    size_t head;
+    size_t len;
+    char data[];
+};
+
+// Узел очереди SBER_ENGINE_LOCKFREE: данные одного вызова write длиной len. Читатели занимают
+// байты узла, атомарно продвигая claimed, поэтому один узел могут дочитывать несколько читателей.
+// Узел освобождается через RCU, когда голова очереди уходит дальше него.
+struct lf_node {
+    struct lf_node *next;
+    struct rcu_head rcu;
+    atomic_long_t claimed;
+    size_t len;
+    char data[];
+};
+
+// Насколько локальная часть счетчика shard_used может разойтись с общей, прежде чем будет в нее перенесена,
+// для очередей, емкость которых намного больше SHARD_BATCH на каждый процессор.
+#define SHARD_BATCH 64
+
+// Счетчики очереди на одном процессоре: каждый процессор увеличивает только свои, поэтому
+// счет не гоняет строки кэша между процессорами. Сумму по процессорам (а для high_water -
+// максимум) собирает queue_stats_sum при обращении к статистике.
+struct queue_stats {
+    u64 bytes_in;
+    u64 bytes_out;
+    u64 writes;
+    u64 reads;
+    u64 short_reads;
+    u64 overflows;
+    u64 busy;
+    u64 alloc_failures;
+    u64 high_water;
+};
+
+// Описывает устройство-очередь: данные одного из механизмов хранения engine, их синхронизацию,
+// учет памяти и статистику. Список сегментов и список записей устроены как очередь Майкла-Скотта
+// с двумя блокировками: читатели сериализуются head_lock, писатели - tail_lock, а `lock` на чтение
+// защищает только от исключительных операций. Шарды и очередь без блокировок вместо `lock`
+// берут engine_sem на чтение.
+struct queue_device {
+    // Сегменты очереди; последний сегмент играет роль фиктивного узла и не удаляется из списка.
+    struct list_head queue;
+    // На запись захватывается сменой механизма, резервом и двухфазным чтением.
+    struct rw_semaphore lock;
+    // Емкость очереди в байтах; для записей считаются только полезные байты.
+    size_t capacity;
+    // Свободные сегменты под pool_lock: пока очередь владеет не более чем pool_target
+    // сегментами, освободившиеся сегменты возвращаются в пул, а не в кэш.
+    struct list_head pool;
+    spinlock_t pool_lock;
+    size_t pool_size;
+    size_t pool_target;
+    // Сколько сегментов сверх резерва пул держит после опустошения; их забирает shrinker.
+    size_t pool_cache;
+    // Сегменты очереди вместе с пулом.
+    size_t nr_chunks;
+    // Связь в списке all_queues.
+    struct list_head entry;
+    // Одно из SBER_ENGINE_*.
+    int engine;
+    // Кольцо не берет `lock`: писатели сериализуются ring_write_lock, читатели - ring_read_lock.
+    struct kfifo ring;
+    void *ring_buf;
+    // Большие составные страницы, отображенные в ring_buf, или NULL для обычных страниц.
+    struct page **ring_huge;
+    // Одно из SBER_RING_PAGES_*.
+    int ring_pages;
+    struct mutex ring_write_lock;
+    struct mutex ring_read_lock;
+    // Отображения кольца в память процессов; пока они есть, кольцо не перевыделяется.
+    atomic_t mmap_count;
+    // Читатели пустой очереди и писатели заполненной.
+    wait_queue_head_t read_wait;
+    wait_queue_head_t write_wait;
+    // Открытые на чтение и на запись дескрипторы: как у канала, без писателей чтение пустой
+    // очереди возвращает 0, а без читателей запись в заполненную очередь возвращает -ENOSPC.
+    atomic_t readers;
+    atomic_t writers;
+    // Записи при framing == SBER_FRAMING_RECORD.
+    struct list_head records;
+    int framing;
+    // Данные, извлеченные до подтверждения, под `lock`; next_token - последний выданный идентификатор.
+    struct list_head pending;
+    u64 next_token;
+    // SBER_ENGINE_SHARD: шарды по процессорам и их заполнение.
+    struct queue_shard __percpu *shards;
+    struct percpu_counter shard_used;
+    // SBER_ENGINE_LOCKFREE: односвязный список от фиктивного узла lf_head до lf_tail.
+    struct lf_node *lf_head;
+    struct lf_node *lf_tail ____cacheline_aligned_in_smp;
+    atomic_long_t lf_used;
+    // Создается при первом переходе на шарды или очередь без блокировок; на запись его
+    // захватывает только queue_lock_all, отмечая это в engine_locked.
+    struct percpu_rw_semaphore engine_sem;
+    bool engine_sem_ready;
+    bool engine_locked;
+    // Память записей и узлов очереди без блокировок в байтах вместе с заголовками.
+    atomic_long_t mem_used;
+    // Память узлов шардов.
+    struct percpu_counter shard_mem;
+    // Одно из SBER_NUMA_*: узел писателя, последнего читателя consumer_node или numa_node.
+    int numa_policy;
+    int numa_node;
+    int consumer_node;
+    // Объекты, прочитанные из памяти своего и чужого узла.
+    atomic_long_t numa_hits;
+    atomic_long_t numa_misses;
+    // Статистика по процессорам.
+    struct queue_stats __percpu *stats;
+    // Каталог очереди в debugfs.
+    struct dentry *debugfs;
+    // Номер очереди в событиях трассировки.
+    u32 id;
+    // Голова списка: head_lock и байты, извлеченные читателями.
+    spinlock_t head_lock ____cacheline_aligned_in_smp;
+    size_t bytes_out;
+    // Хвост списка: tail_lock и байты, добавленные писателями; bytes_in - bytes_out - длина очереди.
+    spinlock_t tail_lock ____cacheline_aligned_in_smp;
+    size_t bytes_in;
+};
+
+// Экземпляр устройства (minor): своя общая очередь queue, свой режим работы mode
+// и флаги flags, где бит MINOR_SINGLE_OPEN занят, пока открыт дескриптор одиночного режима.
+struct queue_minor {
+    struct queue_device queue;
+    int mode;
+    unsigned long flags;
+};
+
+// Именованная очередь параллельного режима: очередь queue, к которой дескрипторы подключаются
+// по имени name через SBER_IOC_ATTACH. refs считает подключенные дескрипторы; с последним
+// из них очередь удаляется из таблицы named_queues и освобождается.
+struct named_queue {
+    struct hlist_node node;
+    refcount_t refs;
+    char name[SBER_QUEUE_NAME_MAX];
+    struct queue_device queue;
+};
+
+// Контекст открытого дескриптора: очередь queue, с которой он работает, и снимок режима mode,
+// в котором экземпляр был открыт. Закрытие опирается на снимок, а не на текущий режим
+// экземпляра, который могли сменить, пока дескриптор был открыт. В параллельном режиме own -
+// собственная очередь дескриптора, а named - именованная очередь, к которой он подключен;
+// после подключения queue указывает на нее, а own живет до закрытия дескриптора.
+// polled отмечает, что дескриптор уже ждал в poll, select или epoll на очереди queue.
+struct queue_file {
+    struct queue_device *queue;
+    struct queue_device *own;
+    struct named_queue *named;
+    int mode;
+    bool polled;
+};
+
+static struct queue_minor *minors;
+// Все очереди модуля: общие очереди экземпляров, очереди параллельного режима и именованные.
+// Список защищен all_queues_lock и нужен shrinker, который освобождает их кэшированные сегменты.
+static LIST_HEAD(all_queues);
+static DEFINE_SPINLOCK(all_queues_lock);
+static struct shrinker *queue_shrinker;
+// Именованные очереди по хешу имени; поиск, добавление и удаление выполняются под named_lock.
+static DEFINE_HASHTABLE(named_queues, NAMED_QUEUE_HASH_BITS);
+static DEFINE_MUTEX(named_lock);
+static struct kmem_cache *chunk_cache;
+// Каталог sber_dev в debugfs с каталогами очередей.
+static struct dentry *queue_debugfs;
+// Подкаталог named каталога sber_dev: имена именованных очередей задает пользователь,
+// поэтому они не должны совпадать с каталогами экземпляров и собственных очередей.
+static struct dentry *named_debugfs;
+// Последний выданный номер очереди.
+static atomic_t queue_ids = ATOMIC_INIT(0);
+
+/**
+ * @brief Возвращает количество сегментов, достаточное для полностью заполненной очереди
+ * с частично прочитанным первым сегментом.
+ *
+ * @param queue_dev Указатель на очередь.
+ */
+static size_t queue_max_chunks(const struct queue_device *queue_dev) {
+    return DIV_ROUND_UP(queue_dev->capacity, chunk_size) + 1;
+}
+
+/**
+ * @brief Инициализирует пустую очередь.
+ *
+ * @param queue_dev Указатель на инициализируемую очередь.
+ *
+ * @return 0 при успехе или -ENOMEM, если не удалось выделить счетчики статистики.
+ */
+static int queue_dev_init(struct queue_device *queue_dev) {
+    queue_dev->stats = alloc_percpu_gfp(struct queue_stats, GFP_KERNEL_ACCOUNT);
+    if (!queue_dev->stats) {
+        return -ENOMEM;
+    }
+    queue_dev->debugfs = NULL;
+    queue_dev->id = atomic_inc_return(&queue_ids);
+    INIT_LIST_HEAD(&queue_dev->queue);
+    init_rwsem(&queue_dev->lock);
+    queue_dev->capacity = READ_ONCE(queue_capacity);
+    INIT_LIST_HEAD(&queue_dev->pool);
+    spin_lock_init(&queue_dev->pool_lock);
+    queue_dev->pool_size = 0;
+    queue_dev->pool_target = 0;
+    queue_dev->pool_cache = min_t(size_t, DIV_ROUND_UP(READ_ONCE(queue_pool_cache), chunk_size),
+                                  queue_max_chunks(queue_dev));
+    queue_dev->nr_chunks = 0;
+    INIT_LIST_HEAD(&queue_dev->entry);
+    queue_dev->engine = SBER_ENGINE_LIST;
+    queue_dev->ring_pages = SBER_RING_PAGES_SMALL;
+    mutex_init(&queue_dev->ring_write_lock);
+    mutex_init(&queue_dev->ring_read_lock);
+    atomic_set(&queue_dev->mmap_count, 0);
+    init_waitqueue_head(&queue_dev->read_wait);
+    init_waitqueue_head(&queue_dev->write_wait);
+    atomic_set(&queue_dev->readers, 0);
+    atomic_set(&queue_dev->writers, 0);
+    INIT_LIST_HEAD(&queue_dev->records);
+    queue_dev->framing = SBER_FRAMING_STREAM;
+    INIT_LIST_HEAD(&queue_dev->pending);
+    queue_dev->next_token = 0;
+    queue_dev->shards = NULL;
+    queue_dev->lf_head = NULL;
+    queue_dev->lf_tail = NULL;
+    atomic_long_set(&queue_dev->lf_used, 0);
+    queue_dev->engine_sem_ready = false;
+    queue_dev->engine_locked = false;
+    atomic_long_set(&queue_dev->mem_used, 0);
+    queue_dev->numa_policy = SBER_NUMA_PRODUCER;
+    queue_dev->numa_node = NUMA_NO_NODE;
+    queue_dev->consumer_node = NUMA_NO_NODE;
+    atomic_long_set(&queue_dev->numa_hits, 0);
+    atomic_long_set(&queue_dev->numa_misses, 0);
+    spin_lock_init(&queue_dev->head_lock);
+    queue_dev->bytes_out = 0;
+    spin_lock_init(&queue_dev->tail_lock);
+    queue_dev->bytes_in = 0;
+    return 0;
+}
+
+/**
+ * @brief Возвращает количество байт, которое еще можно записать в очередь.
+ *
+ * @param queue_dev Указатель на очередь.
+ * @param used Количество байт в очереди.
+ *
+ * Емкость могла быть уменьшена ниже текущего заполнения, тогда свободного места нет.
+ */
+static size_t queue_space(const struct queue_device *queue_dev, size_t used) {
+    return queue_dev->capacity > used ? queue_dev->capacity - used : 0;
+}
+
+/**
+ * @brief Возвращает количество байт в списке сегментов или записей без захвата блокировок.
+ *
+ * @param queue_dev Указатель на очередь.
+ *
+ * Оба счетчика только растут, а писатель увеличивает bytes_in до публикации данных,
+ * поэтому при чтении bytes_out первым разность не бывает отрицательной.
+ */
+static size_t queue_list_len(const struct queue_device *queue_dev) {
+    size_t out = smp_load_acquire(&queue_dev->bytes_out);
+
+    return READ_ONCE(queue_dev->bytes_in) - out;
+}
+
+/**
+ * @brief Возвращает количество байт в очереди без захвата блокировок.
+ *
+ * @param queue_dev Указатель на очередь.
+ *
+ * Значение может устареть сразу после чтения и служит только условием ожидания и опроса.
+ */
+static size_t queue_len(struct queue_device *queue_dev) {
+    switch (READ_ONCE(queue_dev->engine)) {
+    case SBER_ENGINE_RING:
+        return kfifo_len(&queue_dev->ring);
+    case SBER_ENGINE_SHARD:
+        return percpu_counter_sum_positive(&queue_dev->shard_used);
+    case SBER_ENGINE_LOCKFREE:
+        return atomic_long_read(&queue_dev->lf_used);
+    default:
+        return queue_list_len(queue_dev);
+    }
+}
+
+/**
+ * @brief Возвращает заполнение очереди для статистики и трассировки.
+ *
+ * @param queue_dev Указатель на очередь.
+ *
+ * В отличие от queue_len, заполнение шардов берется из приближенного значения счетчика,
+ * чтобы учет каждой операции не суммировал счетчик по всем процессорам.
+ */
+static size_t queue_occupancy(struct queue_device *queue_dev) {
+    if (READ_ONCE(queue_dev->engine) == SBER_ENGINE_SHARD) {
+        return percpu_counter_read_positive(&queue_dev->shard_used);
+    }
+    return queue_len(queue_dev);
+}
+
+/**
+ * @brief Учитывает вызов записи в статистике процессора.
+ *
+ * @param queue_dev Указатель на очередь.
+ * @param ret Количество записанных байт или код ошибки.
+ */
+static void queue_stat_write(struct queue_device *queue_dev, ssize_t ret) {
+    struct queue_stats *stats;
+    size_t len;
+
+    this_cpu_inc(queue_dev->stats->writes);
+    if (ret > 0) {
+        this_cpu_add(queue_dev->stats->bytes_in, ret);
+        len = queue_occupancy(queue_dev);
+        // Сравнение и запись максимума идут на одном процессоре, иначе задача, перенесенная
+        // между ними, могла бы уменьшить максимум другого процессора.
+        stats = get_cpu_ptr(queue_dev->stats);
+        if (len > stats->high_water) {
+            stats->high_water = len;
+        }
+        put_cpu_ptr(queue_dev->stats);
+    } else if (ret == -ENOSPC || ret == -EAGAIN) {
+        this_cpu_inc(queue_dev->stats->overflows);
+    }
+}
+
+/**
+ * @brief Учитывает вызов чтения в статистике процессора.
+ *
+ * @param queue_dev Указатель на очередь.
+ * @param ret Количество прочитанных байт или код ошибки.
+ * @param count Сколько байт вызов мог прочитать.
+ */
+static void queue_stat_read(struct queue_device *queue_dev, ssize_t ret, size_t count) {
+    this_cpu_inc(queue_dev->stats->reads);
+    if (ret > 0) {
+        this_cpu_add(queue_dev->stats->bytes_out, ret);
+    }
+    if ((ret >= 0 || ret == -EAGAIN) && ret < (ssize_t)count) {
+        this_cpu_inc(queue_dev->stats->short_reads);
+    }
+}
+
+/**
+ * @brief Учитывает отказы -EBUSY и ошибки выделения памяти в статистике процессора.
+ *
+ * @param queue_dev Указатель на очередь.
+ * @param ret Результат операции; остальные коды не учитываются.
+ */
+static void queue_stat_error(struct queue_device *queue_dev, long ret) {
+    if (ret == -EBUSY) {
+        this_cpu_inc(queue_dev->stats->busy);
+    } else if (ret == -ENOMEM) {
+        this_cpu_inc(queue_dev->stats->alloc_failures);
+    }
+}
+
+/**
+ * @brief Собирает статистику очереди со всех процессоров без захвата блокировок.
+ *
+ * @param queue_dev Указатель на очередь.
+ * @param stats Сюда записывается сумма счетчиков и наибольшее заполнение.
+ *
+ * Счетчики процессоров читаются по очереди, поэтому снимок не атомарен: запись или чтение,
+ * идущие одновременно со сбором, могут попасть в одни счетчики и не попасть в другие.
+ */
+static void queue_stats_sum(struct queue_device *queue_dev, struct sber_stats *stats) {
+    const struct queue_stats *cpu_stats;
+    int cpu;
+
+    memset(stats, 0, sizeof(*stats));
+    for_each_possible_cpu(cpu) {
+        cpu_stats = per_cpu_ptr(queue_dev->stats, cpu);
+        stats->bytes_in += READ_ONCE(cpu_stats->bytes_in);
+        stats->bytes_out += READ_ONCE(cpu_stats->bytes_out);
+        stats->writes += READ_ONCE(cpu_stats->writes);
+        stats->reads += READ_ONCE(cpu_stats->reads);
+        stats->short_reads += READ_ONCE(cpu_stats->short_reads);
+        stats->overflows += READ_ONCE(cpu_stats->overflows);
+        stats->busy += READ_ONCE(cpu_stats->busy);
+        stats->alloc_failures += READ_ONCE(cpu_stats->alloc_failures);
+        stats->high_water = max_t(u64, stats->high_water, READ_ONCE(cpu_stats->high_water));
+    }
+}
+
+static int queue_stats_show(struct seq_file *m, void *v) {
+    struct sber_stats stats;
+
+    queue_stats_sum(m->private, &stats);
+    seq_printf(m, "bytes_in %llu\n", stats.bytes_in);
+    seq_printf(m, "bytes_out %llu\n", stats.bytes_out);
+    seq_printf(m, "writes %llu\n", stats.writes);
+    seq_printf(m, "reads %llu\n", stats.reads);
+    seq_printf(m, "short_reads %llu\n", stats.short_reads);
+    seq_printf(m, "overflows %llu\n", stats.overflows);
+    seq_printf(m, "busy %llu\n", stats.busy);
+    seq_printf(m, "alloc_failures %llu\n", stats.alloc_failures);
+    seq_printf(m, "high_water %llu\n", stats.high_water);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(queue_stats);
+
+/**
+ * @brief Создает каталог очереди в debugfs с файлом статистики stats.
+ *
+ * @param queue_dev Указатель на инициализированную очередь.
+ * @param name Имя каталога.
+ * @param parent Родительский каталог: queue_debugfs или named_debugfs.
+ *
+ * Как принято для debugfs, ошибки создания не мешают работе очереди: без каталога
+ * статистика остается доступной через SBER_IOC_GET_STATS.
+ */
+static void queue_debugfs_add(struct queue_device *queue_dev, const char *name, struct dentry *parent) {
+    queue_dev->debugfs = debugfs_create_dir(name, parent);
+    debugfs_create_file("stats", 0444, queue_dev->debugfs, queue_dev, &queue_stats_fops);
+}
+
+/**
+ * @brief Возвращает узел NUMA, на котором следует выделять память очереди.
+ *
+ * @param queue_dev Указатель на очередь.
+ *
+ * @return Номер узла или NUMA_NO_NODE, если память выделяется на узле вызывающего.
+ */
+static int queue_alloc_node(const struct queue_device *queue_dev) {
+    switch (READ_ONCE(queue_dev->numa_policy)) {
+    case SBER_NUMA_CONSUMER:
+        return READ_ONCE(queue_dev->consumer_node);
+    case SBER_NUMA_NODE:
+        return READ_ONCE(queue_dev->numa_node);
+    default:
+        return NUMA_NO_NODE;
+    }
+}
+
+/**
+ * @brief Возвращает узел NUMA, в памяти которого лежит объект хранилища.
+ *
+ * @param ptr Объект из kmem_cache или kvmalloc.
+ */
+static int queue_mem_node(const void *ptr) {
+    return page_to_nid(is_vmalloc_addr(ptr) ? vmalloc_to_page(ptr) : virt_to_page(ptr));
+}
+
+/**
+ * @brief Учитывает чтение из очереди: запоминает узел читателя и счетчики попаданий.
+ *
+ * @param queue_dev Указатель на очередь.
+ * @param node Узел читателя.
+ * @param hits Сколько объектов прочитано из памяти узла читателя.
+ * @param misses Сколько объектов прочитано из памяти чужого узла.
+ *
+ * Узел читателя перезаписывается, только если изменился, чтобы не загрязнять строку кэша.
+ */
+static void queue_numa_read(struct queue_device *queue_dev, int node, unsigned long hits, unsigned long misses) {
+    if (READ_ONCE(queue_dev->consumer_node) != node) {
+        WRITE_ONCE(queue_dev->consumer_node, node);
+    }
+    if (hits) {
+        atomic_long_add(hits, &queue_dev->numa_hits);
+    }
+    if (misses) {
+        atomic_long_add(misses, &queue_dev->numa_misses);
+    }
+}
+
+/**
+ * @brief Проверяет, работает ли механизм хранения без `queue_dev->lock`, под engine_sem.
+ *
+ * @param engine Механизм хранения.
+ */
+static bool queue_engine_lockless(int engine) {
+    return engine == SBER_ENGINE_SHARD || engine == SBER_ENGINE_LOCKFREE;
+}
+
+/**
+ * @brief Освобождает блокировку, захваченную queue_lock.
+ *
+ * @param queue_dev Указатель на очередь.
+ * @param engine Механизм хранения, возвращенный queue_lock.
+ * @param reader true для читателя, false для писателя.
+ */
+static void queue_unlock(struct queue_device *queue_dev, int engine, bool reader) {
+    if (engine == SBER_ENGINE_RING) {
+        mutex_unlock(reader ? &queue_dev->ring_read_lock : &queue_dev->ring_write_lock);
+    } else if (queue_engine_lockless(engine)) {
+        percpu_up_read(&queue_dev->engine_sem);
+    } else {
+        up_read(&queue_dev->lock);
+    }
+}
+
+/**
+ * @brief Захватывает блокировку писателя или читателя для текущего механизма хранения очереди.
+ *
+ * @param queue_dev Указатель на очередь.
+ * @param reader true для читателя, false для писателя.
+ *
+ * Для списка сегментов захватывает `queue_dev->lock` на чтение (голову и хвост списка
+ * защищают head_lock и tail_lock), для кольцевого буфера - только мьютекс своей стороны кольца, для шардов и очереди без блокировок -
+ * `queue_dev->engine_sem` на чтение.
+ * Механизм хранения перечитывается после захвата, так как его могли сменить, пока
+ * вызывающий ждал блокировку.
+ *
+ * @return Механизм хранения, для которого захвачена блокировка.
+ */
+static int queue_lock(struct queue_device *queue_dev, bool reader) {
+    int engine;
+
+    for (;;) {
+        engine = READ_ONCE(queue_dev->engine);
+        if (engine == SBER_ENGINE_RING) {
+            mutex_lock(reader ? &queue_dev->ring_read_lock : &queue_dev->ring_write_lock);
+        } else if (queue_engine_lockless(engine)) {
+            percpu_down_read(&queue_dev->engine_sem);
+        } else {
+            down_read(&queue_dev->lock);
+        }
+
+        if (engine == queue_dev->engine) {
+            return engine;
+        }
+
+        queue_unlock(queue_dev, engine, reader);
+    }
+}
+
+/**
+ * @brief Захватывает все блокировки очереди для операций над очередью целиком.
+ *
+ * @param queue_dev Указатель на очередь.
+ *
+ * `queue_dev->engine_sem` захватывается на запись, только пока очередь работает на механизме
+ * без `lock`: сменить такой механизм можно только под engine_sem, а перейти на него - только под `lock`.
+ */
+static void queue_lock_all(struct queue_device *queue_dev) {
+    down_write(&queue_dev->lock);
+    if (queue_engine_lockless(queue_dev->engine)) {
+        percpu_down_write(&queue_dev->engine_sem);
+        queue_dev->engine_locked = true;
+    }
+    mutex_lock(&queue_dev->ring_write_lock);
+    mutex_lock(&queue_dev->ring_read_lock);
+}
+
+/**
+ * @brief Освобождает блокировки, захваченные queue_lock_all.
+ *
+ * @param queue_dev Указатель на очередь.
+ */
+static void queue_unlock_all(struct queue_device *queue_dev) {
+    mutex_unlock(&queue_dev->ring_read_lock);
+    mutex_unlock(&queue_dev->ring_write_lock);
+    if (queue_dev->engine_locked) {
+        queue_dev->engine_locked = false;
+        percpu_up_write(&queue_dev->engine_sem);
+    }
+    up_write(&queue_dev->lock);
+}
+
+/**
+ * @brief Освобождает все сегменты пакета одним вызовом kmem_cache_free_bulk.
+ *
+ * @param batch Указатель на пакет сегментов.
+ */
+static void chunk_batch_flush(struct chunk_batch *batch) {
+    if (batch->nr) {
+        kmem_cache_free_bulk(chunk_cache, batch->nr, batch->chunks);
+        batch->nr = 0;
+    }
+}
+
+/**
+ * @brief Берет свободный сегмент из пакета, при необходимости пополняя его.
+ *
+ * @param batch Указатель на пакет сегментов.
+ * @param want Сколько сегментов еще понадобится вызывающему.
+ * @param node Узел NUMA для новых сегментов или NUMA_NO_NODE.
+ *
+ * Если пакет пуст, выделяет до CHUNK_BATCH сегментов одним вызовом kmem_cache_alloc_bulk.
+ * У kmem_cache_alloc_bulk нет варианта для заданного узла, поэтому сегмент для узла
+ * node выделяется по одному.
+ *
+ * @return Указатель на сегмент или NULL, если не удалось выделить память.
+ */
+static struct queue_chunk *chunk_batch_get(struct chunk_batch *batch, size_t want, int node) {
+    if (!batch->nr) {
+        if (node != NUMA_NO_NODE) {
+            return kmem_cache_alloc_node(chunk_cache, GFP_KERNEL_ACCOUNT, node);
+        }
+        want = clamp_t(size_t, want, 1, CHUNK_BATCH);
+        if (!kmem_cache_alloc_bulk(chunk_cache, GFP_KERNEL_ACCOUNT, want, batch->chunks)) {
+            return NULL;
+        }
+        batch->nr = want;
+    }
+    return batch->chunks[--batch->nr];
+}
+
+/**
+ * @brief Кладет ненужный сегмент в пакет на освобождение.
+ *
+ * @param batch Указатель на пакет сегментов.
+ * @param chunk Освобождаемый сегмент.
+ */
+static void chunk_batch_put(struct chunk_batch *batch, struct queue_chunk *chunk) {
+    if (batch->nr == CHUNK_BATCH) {
+        chunk_batch_flush(batch);
+    }
+    batch->chunks[batch->nr++] = chunk;
+}
+
+/**
+ * @brief Берет сегмент для записи: из пула очереди или из пакета.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под `queue_dev->lock` без спин-блокировок очереди,
+ * так как пакет может обратиться к аллокатору.
+ * @param batch Пакет, из которого берутся новые сегменты, если пул пуст.
+ * @param remaining Сколько байт еще предстоит записать.
+ *
+ * @return Указатель на сегмент или NULL, если не удалось выделить память.
+ */
+static struct queue_chunk *queue_get_chunk(struct queue_device *queue_dev, struct chunk_batch *batch,
+                                           size_t remaining) {
+    struct queue_chunk *chunk;
+
+    spin_lock(&queue_dev->pool_lock);
+    chunk = list_first_entry_or_null(&queue_dev->pool, struct queue_chunk, list);
+    if (chunk) {
+        list_del(&chunk->list);
+        queue_dev->pool_size--;
+    }
+    spin_unlock(&queue_dev->pool_lock);
+    if (chunk) {
+        return chunk;
+    }
+
+    chunk = chunk_batch_get(batch, DIV_ROUND_UP(remaining, chunk_size), queue_alloc_node(queue_dev));
+    if (chunk) {
+        spin_lock(&queue_dev->pool_lock);
+        queue_dev->nr_chunks++;
+        spin_unlock(&queue_dev->pool_lock);
+    }
+    return chunk;
+}
+
+/**
+ * @brief Возвращает освободившийся сегмент в пул очереди или в пакет на освобождение.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под `queue_dev->lock`, в том числе под head_lock.
+ * @param batch Пакет сегментов на освобождение.
+ * @param chunk Освободившийся сегмент, уже удаленный из списка очереди.
+ */
+static void queue_put_chunk(struct queue_device *queue_dev, struct chunk_batch *batch, struct queue_chunk *chunk) {
+    spin_lock(&queue_dev->pool_lock);
+    if (queue_dev->nr_chunks <= queue_dev->pool_target || queue_dev->pool_size < queue_dev->pool_cache) {
+        list_add(&chunk->list, &queue_dev->pool);
+        queue_dev->pool_size++;
+        spin_unlock(&queue_dev->pool_lock);
+        return;
+    }
+
+    queue_dev->nr_chunks--;
+    spin_unlock(&queue_dev->pool_lock);
+    chunk_batch_put(batch, chunk);
+}
+
+/**
+ * @brief Возвращает в пул или в пакет на освобождение все сегменты списка.
+ *
+ * @param queue_dev Указатель на очередь.
+ * @param chunks Список сегментов, не входящих в очередь.
+ * @param batch Пакет сегментов на освобождение.
+ */
+static void queue_put_chunks(struct queue_device *queue_dev, struct list_head *chunks, struct chunk_batch *batch) {
+    struct queue_chunk *chunk, *tmp;
+
+    list_for_each_entry_safe(chunk, tmp, chunks, list) {
+        list_del(&chunk->list);
+        queue_put_chunk(queue_dev, batch, chunk);
+    }
+}
+
+/**
+ * @brief Раскладывает данные по новым сегментам вне очереди.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под `queue_dev->lock` без спин-блокировок очереди.
+ * @param chunks Пустой список, в который добавляются заполненные сегменты.
+ * @param data Данные.
+ * @param count Количество байт.
+ * @param batch Пакет, из которого берутся новые сегменты.
+ *
+ * @return 0 при успехе или -ENOMEM; при ошибке список остается пустым.
+ */
+static int queue_fill_chunks(struct queue_device *queue_dev, struct list_head *chunks, const char *data,
+                             size_t count, struct chunk_batch *batch) {
+    struct queue_chunk *chunk;
+    size_t done = 0;
+
+    while (done < count) {
+        chunk = queue_get_chunk(queue_dev, batch, count - done);
+        if (!chunk) {
+            queue_put_chunks(queue_dev, chunks, batch);
+            return -ENOMEM;
+        }
+
+        chunk->head = 0;
+        chunk->tail = min_t(size_t, count - done, chunk_size);
+        memcpy(chunk->data, data + done, chunk->tail);
+        list_add_tail(&chunk->list, chunks);
+        done += chunk->tail;
+    }
+    return 0;
+}
+
+/**
+ * @brief Освобождает свободные сегменты пула сверх резерва `pool_target`, включая кэш.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под `queue_dev->lock` на запись
+ * или под `queue_dev->pool_lock`.
+ * @param batch Пакет сегментов на освобождение.
+ * @param limit Сколько сегментов освободить не более.
+ *
+ * @return Количество освобожденных сегментов.
+ */
+static size_t queue_pool_shrink(struct queue_device *queue_dev, struct chunk_batch *batch, size_t limit) {
+    struct queue_chunk *chunk;
+    size_t freed = 0;
+
+    while (freed < limit && queue_dev->pool_size && queue_dev->nr_chunks > queue_dev->pool_target) {
+        chunk = list_first_entry(&queue_dev->pool, struct queue_chunk, list);
+        list_del(&chunk->list);
+        queue_dev->pool_size--;
+        queue_dev->nr_chunks--;
+        chunk_batch_put(batch, chunk);
+        freed++;
+    }
+    return freed;
+}
+
+/**
+ * @brief Освобождает свободные сегменты пула сверх резерва `pool_target` и кэша `pool_cache`.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под `queue_dev->lock` на запись.
+ * @param batch Пакет сегментов на освобождение.
+ */
+static void queue_pool_trim(struct queue_device *queue_dev, struct chunk_batch *batch) {
+    if (queue_dev->pool_size > queue_dev->pool_cache) {
+        queue_pool_shrink(queue_dev, batch, queue_dev->pool_size - queue_dev->pool_cache);
+    }
+}
+
+/**
+ * @brief Возвращает количество сегментов пула, которые можно освободить, не трогая резерв.
+ *
+ * @param queue_dev Указатель на очередь; значение читается без блокировок и служит оценкой.
+ */
+static size_t queue_pool_reclaimable(const struct queue_device *queue_dev) {
+    size_t nr_chunks = READ_ONCE(queue_dev->nr_chunks);
+    size_t pool_target = READ_ONCE(queue_dev->pool_target);
+
+    if (nr_chunks <= pool_target) {
+        return 0;
+    }
+    return min(READ_ONCE(queue_dev->pool_size), nr_chunks - pool_target);
+}
+
+/**
+ * @brief Сообщает shrinker, сколько кэшированных сегментов можно освободить во всех очередях.
+ *
+ * @param shrinker Указатель на shrinker модуля.
+ * @param sc Параметры запроса.
+ *
+ * @return Количество сегментов или SHRINK_EMPTY, если освобождать нечего.
+ */
+static unsigned long queue_shrink_count(struct shrinker *shrinker, struct shrink_control *sc) {
+    struct queue_device *queue_dev;
+    unsigned long count = 0;
+
+    spin_lock(&all_queues_lock);
+    list_for_each_entry(queue_dev, &all_queues, entry) {
+        count += queue_pool_reclaimable(queue_dev);
+    }
+    spin_unlock(&all_queues_lock);
+
+    return count ? count : SHRINK_EMPTY;
+}
+
+/**
+ * @brief Освобождает кэшированные сегменты очередей при нехватке памяти.
+ *
+ * @param shrinker Указатель на shrinker модуля.
+ * @param sc Параметры запроса: nr_to_scan - сколько сегментов освободить.
+ *
+ * Пул очереди меняется под pool_lock, а `queue_dev->lock` на чтение исключает смену механизма
+ * и изменение резерва. Очереди, у которых `lock` захвачен на запись, пропускаются, чтобы
+ * не ждать в контексте освобождения памяти. Пройденные очереди переносятся в конец списка,
+ * поэтому следующий вызов начинает с других очередей.
+ *
+ * @return Количество освобожденных сегментов или SHRINK_STOP, если освободить ничего не удалось.
+ */
+static unsigned long queue_shrink_scan(struct shrinker *shrinker, struct shrink_control *sc) {
+    struct chunk_batch batch = { .nr = 0 };
+    struct queue_device *queue_dev, *tmp;
+    unsigned long freed = 0;
+    LIST_HEAD(scanned);
+
+    spin_lock(&all_queues_lock);
+    list_for_each_entry_safe(queue_dev, tmp, &all_queues, entry) {
+        if (freed >= sc->nr_to_scan) {
+            break;
+        }
+        list_move_tail(&queue_dev->entry, &scanned);
+        if (!down_read_trylock(&queue_dev->lock)) {
+            continue;
+        }
+        spin_lock(&queue_dev->pool_lock);
+        freed += queue_pool_shrink(queue_dev, &batch, sc->nr_to_scan - freed);
+        spin_unlock(&queue_dev->pool_lock);
+        up_read(&queue_dev->lock);
+    }
+    list_splice_tail(&scanned, &all_queues);
+    spin_unlock(&all_queues_lock);
+    chunk_batch_flush(&batch);
+
+    if (freed) {
+        sber_info("sber_device: Shrinker freed %lu chunks\n", freed);
+    }
+    return freed ? freed : SHRINK_STOP;
+}
+
+/**
+ * @brief Добавляет очередь в список all_queues, где ее находит shrinker.
+ *
+ * @param queue_dev Указатель на инициализированную очередь.
+ */
+static void queue_register(struct queue_device *queue_dev) {
+    spin_lock(&all_queues_lock);
+    list_add_tail(&queue_dev->entry, &all_queues);
+    spin_unlock(&all_queues_lock);
+}
+
+/**
+ * @brief Удаляет очередь из списка all_queues; после возврата shrinker к ней не обращается.
+ *
+ * @param queue_dev Указатель на очередь.
+ */
+static void queue_unregister(struct queue_device *queue_dev) {
+    spin_lock(&all_queues_lock);
+    list_del_init(&queue_dev->entry);
+    spin_unlock(&all_queues_lock);
+}
+
+/**
+ * @brief Задает, сколько свободных сегментов очередь держит в пуле сверх резерва.
+ *
+ * @param queue_dev Указатель на очередь.
+ * @param bytes Объем кэша в байтах (не больше емкости очереди); 0 отключает кэш.
+ *
+ * Кэш пополняется сегментами, освободившимися при чтении, и отдается shrinker при нехватке
+ * памяти, поэтому всплески записи не обращаются к аллокатору, а память простаивающей
+ * очереди не закреплена навсегда. Лишние сегменты пула при уменьшении кэша освобождаются.
+ *
+ * @return 0 при успехе или -EINVAL для кэша больше емкости очереди.
+ */
+static int queue_set_pool_cache(struct queue_device *queue_dev, u64 bytes) {
+    struct chunk_batch batch = { .nr = 0 };
+
+    down_write(&queue_dev->lock);
+    if (bytes > queue_dev->capacity) {
+        up_write(&queue_dev->lock);
+        return -EINVAL;
+    }
+    queue_dev->pool_cache = DIV_ROUND_UP(bytes, chunk_size);
+    queue_pool_trim(queue_dev, &batch);
+    up_write(&queue_dev->lock);
+    chunk_batch_flush(&batch);
+
+    return 0;
+}
+
+/**
+ * @brief Резервирует сегменты под указанное количество байт.
+ *
+ * @param queue_dev Указатель на очередь.
+ * @param bytes Сколько байт очередь должна вмещать без обращения к аллокатору (не больше емкости очереди).
+ *
+ * Дополняет пул свободными сегментами так, чтобы очередь владела достаточным числом сегментов,
+ * и запоминает резерв: сегменты в его пределах не возвращаются в кэш при чтении и закрытии.
+ * Лишние сегменты пула при уменьшении резерва освобождаются. Нулевой размер снимает резерв.
+ *
+ * @return 0 при успехе, -EINVAL при слишком большом резерве или -ENOMEM, если выделить
+ * удалось только часть сегментов.
+ */
+static int queue_reserve(struct queue_device *queue_dev, u64 bytes) {
+    struct chunk_batch batch = { .nr = 0 };
+    struct queue_chunk *chunk;
+    int ret = 0;
+
+    down_write(&queue_dev->lock);
+    if (bytes > queue_dev->capacity) {
+        up_write(&queue_dev->lock);
+        return -EINVAL;
+    }
+
+    queue_dev->pool_target = bytes ? min_t(size_t, DIV_ROUND_UP(bytes, chunk_size) + 1,
+                                           queue_max_chunks(queue_dev)) : 0;
+    while (queue_dev->nr_chunks < queue_dev->pool_target) {
+        chunk = chunk_batch_get(&batch, queue_dev->pool_target - queue_dev->nr_chunks, queue_alloc_node(queue_dev));
+        if (!chunk) {
+            ret = -ENOMEM;
+            break;
+        }
+        list_add(&chunk->list, &queue_dev->pool);
+        queue_dev->pool_size++;
+        queue_dev->nr_chunks++;
+    }
+    queue_pool_trim(queue_dev, &batch);
+    up_write(&queue_dev->lock);
+    chunk_batch_flush(&batch);
+
+    return ret;
+}
+
+/**
+ * @brief Учитывает в памяти очереди запись, перешедшую в список записей или в pending.
+ *
+ * @param queue_dev Указатель на очередь.
+ * @param record Запись очереди.
+ */
+static void queue_record_charge(struct queue_device *queue_dev, const struct queue_record *record) {
+    atomic_long_add(struct_size(record, data, record->len), &queue_dev->mem_used);
+}
+
+/**
+ * @brief Снимает с учета памяти очереди запись, покинувшую список записей или pending.
+ *
+ * @param queue_dev Указатель на очередь.
+ * @param record Запись очереди.
+ */
+static void queue_record_uncharge(struct queue_device *queue_dev, const struct queue_record *record) {
+    atomic_long_sub(struct_size(record, data, record->len), &queue_dev->mem_used);
+}
+
+/**
+ * @brief Снимает запись с учета памяти очереди и освобождает ее.
+ *
+ * @param queue_dev Указатель на очередь.
+ * @param record Запись, уже удаленная из списка.
+ */
+static void queue_record_free(struct queue_device *queue_dev, struct queue_record *record) {
+    queue_record_uncharge(queue_dev, record);
+    kvfree(record);
+}
+
+/**
+ * @brief Возвращает объем памяти, которую занимает очередь, в байтах.
+ *
+ * @param queue_dev Указатель на очередь.
+ *
+ * Учитываются сегменты вместе с пулом, буфер кольца, записи, неподтвержденные данные и узлы
+ * шардов и очереди без блокировок вместе с заголовками. `queue_dev->lock` на чтение не дает
+ * сменить механизм хранения и перевыделить кольцо во время подсчета.
+ */
+static u64 queue_memory(struct queue_device *queue_dev) {
+    u64 bytes;
+
+    down_read(&queue_dev->lock);
+    bytes = atomic_long_read(&queue_dev->mem_used);
+    bytes += (u64)READ_ONCE(queue_dev->nr_chunks) * kmem_cache_size(chunk_cache);
+    if (queue_dev->ring_buf) {
+        bytes += kfifo_size(&queue_dev->ring);
+    }
+    if (queue_dev->shards) {
+        bytes += percpu_counter_sum_positive(&queue_dev->shard_mem);
+    }
+    up_read(&queue_dev->lock);
+    return bytes;
+}
+
+/**
+ * @brief Удаляет данные из всех шардов очереди.
+ *
+ * @param queue_dev Указатель на очередь с выделенными шардами, вызывается под queue_lock_all.
+ */
+static void queue_shards_purge(struct queue_device *queue_dev) {
+    struct shard_node *node, *tmp;
+    struct queue_shard *shard;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        shard = per_cpu_ptr(queue_dev->shards, cpu);
+        list_for_each_entry_safe(node, tmp, &shard->nodes, list) {
+            list_del(&node->list);
+            kvfree(node);
+        }
+    }
+    percpu_counter_set(&queue_dev->shard_used, 0);
+    percpu_counter_set(&queue_dev->shard_mem, 0);
+}
+
+/**
+ * @brief Выделяет шарды очереди, если они еще не выделены.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под queue_lock_all.
+ *
+ * @return 0 при успехе или код ошибки.
+ */
+static int queue_shards_alloc(struct queue_device *queue_dev) {
+    struct queue_shard __percpu *shards;
+    struct queue_shard *shard;
+    int cpu;
+    int ret;
+
+    if (queue_dev->shards) {
+        return 0;
+    }
+
+    shards = alloc_percpu_gfp(struct queue_shard, GFP_KERNEL_ACCOUNT);
+    if (!shards) {
+        return -ENOMEM;
+    }
+    for_each_possible_cpu(cpu) {
+        shard = per_cpu_ptr(shards, cpu);
+        spin_lock_init(&shard->lock);
+        INIT_LIST_HEAD(&shard->nodes);
+    }
+
+    ret = percpu_counter_init(&queue_dev->shard_used, 0, GFP_KERNEL_ACCOUNT);
+    if (ret) {
+        free_percpu(shards);
+        return ret;
+    }
+    ret = percpu_counter_init(&queue_dev->shard_mem, 0, GFP_KERNEL_ACCOUNT);
+    if (ret) {
+        percpu_counter_destroy(&queue_dev->shard_used);
+        free_percpu(shards);
+        return ret;
+    }
+
+    queue_dev->shards = shards;
+    return 0;
+}
+
+/**
+ * @brief Удаляет данные из очереди без блокировок, оставляя только фиктивный узел.
+ *
+ * @param queue_dev Указатель на очередь с фиктивным узлом, вызывается под queue_lock_all.
+ *
+ * Под engine_sem на запись ни один читатель не находится внутри rcu_read_lock,
+ * поэтому узлы освобождаются сразу.
+ */
+static void queue_lf_purge(struct queue_device *queue_dev) {
+    struct lf_node *node = queue_dev->lf_head->next;
+    struct lf_node *next;
+
+    while (node) {
+        next = node->next;
+        atomic_long_sub(struct_size(node, data, node->len), &queue_dev->mem_used);
+        kvfree(node);
+        node = next;
+    }
+    queue_dev->lf_head->next = NULL;
+    queue_dev->lf_tail = queue_dev->lf_head;
+    atomic_long_set(&queue_dev->lf_used, 0);
+}
+
+/**
+ * @brief Создает фиктивный узел очереди без блокировок, если он еще не создан.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под queue_lock_all.
+ *
+ * @return 0 при успехе или -ENOMEM.
+ */
+static int queue_lf_alloc(struct queue_device *queue_dev) {
+    struct lf_node *dummy;
+
+    if (queue_dev->lf_head) {
+        return 0;
+    }
+
+    dummy = kvmalloc(sizeof(*dummy), GFP_KERNEL_ACCOUNT);
+    if (!dummy) {
+        return -ENOMEM;
+    }
+    atomic_long_add(sizeof(*dummy), &queue_dev->mem_used);
+    dummy->next = NULL;
+    dummy->len = 0;
+    atomic_long_set(&dummy->claimed, 0);
+    queue_dev->lf_head = dummy;
+    queue_dev->lf_tail = dummy;
+    return 0;
+}
+
+/**
+ * @brief Создает engine_sem для механизмов без `queue_dev->lock`, если он еще не создан.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под queue_lock_all.
+ *
+ * @return 0 при успехе или код ошибки.
+ */
+static int queue_engine_sem_init(struct queue_device *queue_dev) {
+    int ret;
+
+    if (queue_dev->engine_sem_ready) {
+        return 0;
+    }
+    ret = percpu_init_rwsem(&queue_dev->engine_sem);
+    if (!ret) {
+        queue_dev->engine_sem_ready = true;
+    }
+    return ret;
+}
+
+/**
+ * @brief Освобождает шарды, фиктивный узел очереди без блокировок и engine_sem.
+ *
+ * @param queue_dev Указатель на пустую очередь, которую больше никто не использует.
+ */
+static void queue_lockless_free(struct queue_device *queue_dev) {
+    if (queue_dev->shards) {
+        percpu_counter_destroy(&queue_dev->shard_used);
+        percpu_counter_destroy(&queue_dev->shard_mem);
+        free_percpu(queue_dev->shards);
+        queue_dev->shards = NULL;
+    }
+    if (queue_dev->lf_head) {
+        atomic_long_sub(struct_size(queue_dev->lf_head, data, queue_dev->lf_head->len), &queue_dev->mem_used);
+        kvfree(queue_dev->lf_head);
+    }
+    queue_dev->lf_head = NULL;
+    queue_dev->lf_tail = NULL;
+    if (queue_dev->engine_sem_ready) {
+        percpu_free_rwsem(&queue_dev->engine_sem);
+        queue_dev->engine_sem_ready = false;
+    }
+}
+
+/**
+ * @brief Удаляет все данные очереди, снимает резерв и освобождает все сегменты, включая пул.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под queue_lock_all.
+ */
+static void queue_purge(struct queue_device *queue_dev) {
+    struct chunk_batch batch = { .nr = 0 };
+    struct queue_chunk *chunk, *tmp;
+    struct queue_record *record, *next;
+
+    queue_dev->pool_target = 0;
+
+    list_for_each_entry_safe(chunk, tmp, &queue_dev->queue, list) {
+        list_del(&chunk->list);
+        queue_put_chunk(queue_dev, &batch, chunk);
+    }
+    queue_pool_shrink(queue_dev, &batch, SIZE_MAX);
+    chunk_batch_flush(&batch);
+    list_for_each_entry_safe(record, next, &queue_dev->records, list) {
+        list_del(&record->list);
+        queue_record_free(queue_dev, record);
+    }
+    list_for_each_entry_safe(record, next, &queue_dev->pending, list) {
+        list_del(&record->list);
+        queue_record_free(queue_dev, record);
+    }
+    if (queue_dev->shards) {
+        queue_shards_purge(queue_dev);
+    }
+    if (queue_dev->lf_head) {
+        queue_lf_purge(queue_dev);
+    }
+    queue_dev->bytes_in = 0;
+    queue_dev->bytes_out = 0;
+    kfifo_reset(&queue_dev->ring);
+}
+
+/**
+ * @brief Освобождает большие страницы кольца.
+ *
+ * @param hpages Массив составных страниц; незаполненные элементы равны NULL.
+ * @param nr Размер массива.
+ */
+static void queue_ring_huge_free(struct page **hpages, size_t nr) {
+    size_t i;
+
+    for (i = 0; i < nr; i++) {
+        if (hpages[i]) {
+            __free_pages(hpages[i], PMD_ORDER);
+        }
+    }
+    kvfree(hpages);
+}
+
+/**
+ * @brief Выделяет буфер кольца из больших составных страниц.
+ *
+ * @param size Размер буфера, кратный PMD_SIZE.
+ * @param node Узел NUMA для страниц или NUMA_NO_NODE.
+ * @param hpages Сюда записывается массив составных страниц буфера.
+ *
+ * Страницы отображаются в непрерывный адрес ядра через vmap, чтобы kfifo работал с буфером
+ * как с обычным; в процесс они отображаются целиком через queue_huge_vm_ops. Страницы
+ * обнуляются: буфер отображается в память процесса. Выделение не уходит в долгое уплотнение
+ * памяти: если больших страниц нет, вызывающий получает -ENOMEM сразу.
+ *
+ * @return Адрес буфера или NULL.
+ */
+static void *queue_ring_huge_alloc(size_t size, int node, struct page ***hpages) {
+    size_t nr_huge = size >> PMD_SHIFT, nr_pages = size >> PAGE_SHIFT, i, j;
+    struct page **huge, **pages;
+    void *buf = NULL;
+
+    huge = kvcalloc(nr_huge, sizeof(*huge), GFP_KERNEL_ACCOUNT);
+    pages = kvmalloc_array(nr_pages, sizeof(*pages), GFP_KERNEL);
+    if (!huge || !pages) {
+        goto out;
+    }
+
+    for (i = 0; i < nr_huge; i++) {
+        huge[i] = alloc_pages_node(node, GFP_KERNEL_ACCOUNT | __GFP_COMP | __GFP_ZERO | __GFP_NOWARN |
+                                   __GFP_NORETRY, PMD_ORDER);
+        if (!huge[i]) {
+            goto out;
+        }
+        for (j = 0; j < (1UL << PMD_ORDER); j++) {
+            pages[(i << PMD_ORDER) + j] = nth_page(huge[i], j);
+        }
+    }
+    buf = vmap(pages, nr_pages, VM_MAP, PAGE_KERNEL);
+out:
+    kvfree(pages);
+    if (!buf && huge) {
+        queue_ring_huge_free(huge, nr_huge);
+        huge = NULL;
+    }
+    *hpages = huge;
+    return buf;
+}
+
+/**
+ * @brief Освобождает память буфера кольца, не сбрасывая описание кольца.
+ *
+ * @param queue_dev Указатель на очередь; размер буфера берется из queue_dev->ring.
+ */
+static void queue_ring_release(struct queue_device *queue_dev) {
+    if (queue_dev->ring_huge) {
+        vunmap(queue_dev->ring_buf);
+        queue_ring_huge_free(queue_dev->ring_huge, kfifo_size(&queue_dev->ring) >> PMD_SHIFT);
+    } else {
+        vfree(queue_dev->ring_buf);
+    }
+}
+
+/**
+ * @brief Выделяет кольцевой буфер под емкость очереди.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под queue_lock_all для пустого кольца.
+ * @param capacity Емкость очереди; размер кольца округляется до степени двойки.
+ *
+ * Прежний буфер кольца освобождается только после успешного выделения нового.
+ * Обычный буфер выделяется через __vmalloc: емкость может достигать сотен мегабайт,
+ * а буфер должен состоять из целых страниц, чтобы его можно было отобразить в память процесса.
+ * Страницы обнуляются и учитываются в memory cgroup; в процесс они отображаются при обращении
+ * через queue_vm_fault. Буфер из больших страниц (SBER_RING_PAGES_HUGE) не меньше PMD_SIZE,
+ * учитывается в memory cgroup и выделяется на узле NUMA по размещению очереди.
+ *
+ * @return 0 при успехе, -EBUSY, если кольцо отображено в память, или -ENOMEM.
+ */
+static int queue_ring_alloc(struct queue_device *queue_dev, size_t capacity) {
+    bool huge = queue_dev->ring_pages == SBER_RING_PAGES_HUGE;
+    size_t size = roundup_pow_of_two(max_t(size_t, capacity, huge ? PMD_SIZE : PAGE_SIZE));
+    struct page **hpages = NULL;
+    void *buf;
+
+    if (atomic_read(&queue_dev->mmap_count)) {
+        return -EBUSY;
+    }
+
+    if (huge) {
+        buf = queue_ring_huge_alloc(size, queue_alloc_node(queue_dev), &hpages);
+    } else {
+        buf = __vmalloc(size, GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+    }
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    queue_ring_release(queue_dev);
+    queue_dev->ring_buf = buf;
+    queue_dev->ring_huge = hpages;
+    return kfifo_init(&queue_dev->ring, buf, size);
+}
+
+/**
+ * @brief Освобождает кольцевой буфер очереди.
+ *
+ * @param queue_dev Указатель на очередь.
+ */
+static void queue_ring_free(struct queue_device *queue_dev) {
+    queue_ring_release(queue_dev);
+    queue_dev->ring_buf = NULL;
+    queue_dev->ring_huge = NULL;
+    memset(&queue_dev->ring, 0, sizeof(queue_dev->ring));
+}
+
+/**
+ * @brief Выбирает страницы кольцевого буфера очереди.
+ *
+ * @param queue_dev Указатель на очередь.
+ * @param pages Одно из SBER_RING_PAGES_*.
+ *
+ * Если очередь уже использует кольцо, оно перевыделяется из страниц нового вида; при ошибке
+ * остаются прежние страницы. Для остальных механизмов выбор применится при переходе на кольцо.
+ *
+ * @return 0 при успехе, -EINVAL для неизвестного вида страниц, -EBUSY для непустого или
+ * отображенного в память кольца, -ENOMEM, если больших страниц не нашлось.
+ */
+static int queue_set_ring_pages(struct queue_device *queue_dev, u32 pages) {
+    int old, ret = 0;
+
+    if (pages > SBER_RING_PAGES_HUGE) {
+        return -EINVAL;
+    }
+
+    queue_lock_all(queue_dev);
+    old = queue_dev->ring_pages;
+    if (old == pages) {
+        goto out;
+    }
+    queue_dev->ring_pages = pages;
+    if (queue_dev->engine == SBER_ENGINE_RING) {
+        ret = kfifo_is_empty(&queue_dev->ring) ? queue_ring_alloc(queue_dev, queue_dev->capacity) : -EBUSY;
+        if (ret) {
+            queue_dev->ring_pages = old;
+        }
+    }
+out:
+    queue_unlock_all(queue_dev);
+    return ret;
+}
+
+/**
+ * @brief Переключает механизм хранения очереди.
+ *
+ * @param queue_dev Указатель на очередь.
+ * @param engine Один из механизмов SBER_ENGINE_*.
+ *
+ * Переключение возможно только для пустой очереди. Кольцевой буфер выделяется
+ * при переходе на кольцо и освобождается при переходе на другой механизм. Кольцо хранит
+ * поток байт, поэтому очередь с разбиением на записи нельзя перевести на кольцо.
+ * Неподтвержденные данные вернутся в очередь, поэтому она считается непустой, пока они есть.
+ *
+ * @return 0 при успехе, -EINVAL для неизвестного механизма или очереди с разбиением
+ * на записи, -EBUSY для непустой очереди или отображенного в память кольца, -ENOMEM.
+ */
+static int queue_set_engine(struct queue_device *queue_dev, u32 engine) {
+    int ret = 0;
+
+    if (engine > SBER_ENGINE_LOCKFREE) {
+        return -EINVAL;
+    }
+
+    queue_lock_all(queue_dev);
+    if (queue_dev->engine == engine) {
+        goto out;
+    }
+    if (queue_dev->framing != SBER_FRAMING_STREAM) {
+        ret = -EINVAL;
+        goto out;
+    }
+    if (queue_list_len(queue_dev) || !list_empty(&queue_dev->pending) || !kfifo_is_empty(&queue_dev->ring) ||
+        (queue_dev->shards && percpu_counter_sum(&queue_dev->shard_used)) ||
+        atomic_long_read(&queue_dev->lf_used) ||
+        atomic_read(&queue_dev->mmap_count)) {
+        ret = -EBUSY;
+        goto out;
+    }
+
+    if (engine == SBER_ENGINE_RING) {
+        ret = queue_ring_alloc(queue_dev, queue_dev->capacity);
+    } else {
+        queue_ring_free(queue_dev);
+    }
+    if (!ret && queue_engine_lockless(engine)) {
+        ret = queue_engine_sem_init(queue_dev);
+    }
+    if (!ret && engine == SBER_ENGINE_SHARD) {
+        ret = queue_shards_alloc(queue_dev);
+    }
+    if (!ret && engine == SBER_ENGINE_LOCKFREE) {
+        ret = queue_lf_alloc(queue_dev);
+    }
+    if (!ret) {
+        WRITE_ONCE(queue_dev->engine, engine);
+    }
+out:
+    queue_unlock_all(queue_dev);
+    return ret;
+}
+
+/**
+ * @brief Переключает разбиение данных очереди на записи.
+ *
+ * @param queue_dev Указатель на очередь.
+ * @param framing SBER_FRAMING_STREAM или SBER_FRAMING_RECORD.
+ *
+ * Переключение возможно только для пустой очереди на списке сегментов
+ * без неподтвержденных данных.
+ *
+ * @return 0 при успехе, -EINVAL для неизвестного разбиения или очереди на кольцевом
+ * буфере, -EBUSY для непустой очереди.
+ */
+static int queue_set_framing(struct queue_device *queue_dev, u32 framing) {
+    int ret = 0;
+
+    if (framing != SBER_FRAMING_STREAM && framing != SBER_FRAMING_RECORD) {
+        return -EINVAL;
+    }
+
+    queue_lock_all(queue_dev);
+    if (queue_dev->framing == framing) {
+        goto out;
+    }
+    if (queue_dev->engine != SBER_ENGINE_LIST) {
+        ret = -EINVAL;
+    } else if (queue_list_len(queue_dev) || !list_empty(&queue_dev->pending)) {
+        ret = -EBUSY;
+    } else {
+        WRITE_ONCE(queue_dev->framing, framing);
+    }
+out:
+    queue_unlock_all(queue_dev);
+    return ret;
+}
+
+/**
+ * @brief Изменяет емкость очереди.
+ *
+ * @param queue_dev Указатель на очередь.
+ * @param bytes Новая емкость в байтах, от 1 до QUEUE_MAX_CAPACITY.
+ *
+ * Уменьшение емкости не удаляет данные: запись будет отклоняться, пока очередь
+ * не опустеет ниже новой емкости. Резерв пула ограничивается новой емкостью.
+ * Кольцевой буфер, который меньше новой емкости, перевыделяется, поэтому
+ * увеличение емкости кольца возможно только для пустой очереди.
+ *
+ * @return 0 при успехе, -EINVAL для недопустимой емкости, -EBUSY или -ENOMEM.
+ */
+static int queue_set_capacity(struct queue_device *queue_dev, u64 bytes) {
+    struct chunk_batch batch = { .nr = 0 };
+    int ret = 0;
+
+    if (!bytes || bytes > QUEUE_MAX_CAPACITY) {
+        return -EINVAL;
+    }
+
+    queue_lock_all(queue_dev);
+    if (queue_dev->engine == SBER_ENGINE_RING && bytes > kfifo_size(&queue_dev->ring)) {
+        if (!kfifo_is_empty(&queue_dev->ring)) {
+            ret = -EBUSY;
+            goto out;
+        }
+        ret = queue_ring_alloc(queue_dev, bytes);
+        if (ret) {
+            goto out;
+        }
+    }
+
+    queue_dev->capacity = bytes;
+    queue_dev->pool_target = min(queue_dev->pool_target, queue_max_chunks(queue_dev));
+    queue_pool_trim(queue_dev, &batch);
+out:
+    queue_unlock_all(queue_dev);
+    chunk_batch_flush(&batch);
+    if (!ret) {
+        wake_up_interruptible_poll(&queue_dev->write_wait, EPOLLOUT | EPOLLWRNORM);
+    }
+    return ret;
+}
+
+/**
+ * @brief Возвращает данные в голову списка сегментов очереди.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под `queue_dev->lock` на запись.
+ * @param data Возвращаемые данные.
+ * @param count Количество байт.
+ * @param batch Пакет, из которого берутся новые сегменты.
+ *
+ * Данные размещаются в новых сегментах перед первым сегментом очереди. Емкость
+ * не проверяется: место под эти данные уже было занято до их извлечения.
+ *
+ * @return 0 при успехе или -ENOMEM; при ошибке очередь не меняется.
+ */
+static int queue_list_unread(struct queue_device *queue_dev, const char *data, size_t count,
+                             struct chunk_batch *batch) {
+    LIST_HEAD(chunks);
+
+    if (queue_fill_chunks(queue_dev, &chunks, data, count, batch)) {
+        return -ENOMEM;
+    }
+
+    list_splice(&chunks, &queue_dev->queue);
+    queue_dev->bytes_in += count;
+    return 0;
+}
+
+/**
+ * @brief Возвращает неподтвержденные данные в голову очереди.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под `queue_dev->lock` на запись.
+ * @param record Данные, уже удаленные из списка pending; запись переходит очереди или освобождается.
+ * @param batch Пакет, из которого берутся новые сегменты.
+ */
+static void queue_requeue(struct queue_device *queue_dev, struct queue_record *record, struct chunk_batch *batch) {
+    if (queue_dev->framing == SBER_FRAMING_RECORD) {
+        list_add(&record->list, &queue_dev->records);
+        queue_dev->bytes_in += record->len;
+        return;
+    }
+
+    if (queue_list_unread(queue_dev, record->data, record->len, batch)) {
+        pr_err_ratelimited("sber_device: Lost %zu unacknowledged bytes\n", record->len);
+    }
+    queue_record_free(queue_dev, record);
+}
+
+/**
+ * @brief Возвращает в очередь все неподтвержденные данные, извлеченные через дескриптор.
+ *
+ * @param queue_dev Указатель на очередь.
+ * @param file Закрываемый дескриптор.
+ *
+ * Данные возвращаются в голову очереди в том порядке, в котором были извлечены.
+ */
+static void queue_requeue_pending(struct queue_device *queue_dev, struct file *file) {
+    struct chunk_batch batch = { .nr = 0 };
+    struct queue_record *record, *prev;
+    bool requeued = false;
+
+    down_write(&queue_dev->lock);
+    list_for_each_entry_safe_reverse(record, prev, &queue_dev->pending, list) {
+        if (record->owner == file) {
+            list_del(&record->list);
+            queue_requeue(queue_dev, record, &batch);
+            requeued = true;
+        }
+    }
+    up_write(&queue_dev->lock);
+    chunk_batch_flush(&batch);
+
+    if (requeued) {
+        wake_up_interruptible_poll(&queue_dev->read_wait, EPOLLIN | EPOLLRDNORM);
+    }
+}
+
+/**
+ * @brief Возвращает в голову очереди данные, извлеченные читателем, но не переданные ему.
+ *
+ * @param queue_dev Указатель на очередь.
+ * @param records Список извлеченных записей в исходном порядке или NULL для потока байт;
+ * при успехе записи переходят очереди, и список становится пустым.
+ * @param data Непереданные данные потока.
+ * @param count Количество байт потока.
+ *
+ * Вернуть данные можно только в список сегментов или записей с тем же разбиением: у кольца,
+ * шардов и очереди без блокировок нет операции возврата в голову.
+ *
+ * @return 0 при успехе, -ENODEV, если механизм хранения или разбиение сменили, или -ENOMEM.
+ */
+static int queue_unread(struct queue_device *queue_dev, struct list_head *records, const char *data, size_t count) {
+    struct chunk_batch batch = { .nr = 0 };
+    int framing = records ? SBER_FRAMING_RECORD : SBER_FRAMING_STREAM;
+    struct queue_record *record;
+    int ret = -ENODEV;
+
+    down_write(&queue_dev->lock);
+    if (queue_dev->engine == SBER_ENGINE_LIST && queue_dev->framing == framing) {
+        if (records) {
+            list_for_each_entry(record, records, list) {
+                queue_record_charge(queue_dev, record);
+                queue_dev->bytes_in += record->len;
+            }
+            list_splice_init(records, &queue_dev->records);
+            ret = 0;
+        } else {
+            ret = queue_list_unread(queue_dev, data, count, &batch);
+        }
+    }
+    up_write(&queue_dev->lock);
+    chunk_batch_flush(&batch);
+
+    if (!ret) {
+        wake_up_interruptible_poll(&queue_dev->read_wait, EPOLLIN | EPOLLRDNORM);
+    }
+    return ret;
+}
+
+/**
+ * @brief Возвращает экземпляр устройства по inode его файла.
+ *
+ * @param inode Указатель на структуру inode.
+ */
+static struct queue_minor *queue_minor_of(const struct inode *inode) {
+    return &minors[iminor(inode) - MINOR(first)];
+}
+
+/**
+ * @brief Возвращает очередь, с которой работает открытый дескриптор.
+ *
+ * @param file Указатель на структуру файла, ассоциированную с устройством.
+ */
+static struct queue_device *queue_of(const struct file *file) {
+    return READ_ONCE(((struct queue_file *)file->private_data)->queue);
+}
+
+/**
+ * @brief Освобождает данные и буферы очереди, которой больше не пользуется ни один дескриптор.
+ *
+ * @param queue_dev Указатель на очередь; саму структуру освобождает вызывающий.
+ */
+static void queue_teardown(struct queue_device *queue_dev) {
+    debugfs_remove(queue_dev->debugfs);
+    queue_unregister(queue_dev);
+    queue_lock_all(queue_dev);
+    queue_purge(queue_dev);
+    queue_unlock_all(queue_dev);
+    queue_ring_free(queue_dev);
+    queue_lockless_free(queue_dev);
+    free_percpu(queue_dev->stats);
+}
+
+/**
+ * @brief Находит именованную очередь или создает ее и захватывает на нее ссылку.
+ *
+ * @param name Имя очереди, завершенное нулем.
+ *
+ * @return Указатель на очередь или NULL, если не удалось выделить память.
+ */
+static struct named_queue *named_queue_get(const char *name) {
+    u32 hash = full_name_hash(NULL, name, strlen(name));
+    struct named_queue *named;
+
+    mutex_lock(&named_lock);
+    hash_for_each_possible(named_queues, named, node, hash) {
+        if (!strcmp(named->name, name)) {
+            refcount_inc(&named->refs);
+            goto out;
+        }
+    }
+
+    named = kzalloc(sizeof(*named), GFP_KERNEL_ACCOUNT);
+    if (named && queue_dev_init(&named->queue)) {
+        kfree(named);
+        named = NULL;
+    }
+    if (named) {
+        refcount_set(&named->refs, 1);
+        strscpy(named->name, name, sizeof(named->name));
+        queue_register(&named->queue);
+        queue_debugfs_add(&named->queue, named->name, named_debugfs);
+        hash_add(named_queues, &named->node, hash);
+        sber_info("sber_device: Created queue %s\n", named->name);
+    }
+out:
+    mutex_unlock(&named_lock);
+    return named;
+}
+
+/**
+ * @brief Отпускает ссылку на именованную очередь и освобождает ее вместе с последней ссылкой.
+ *
+ * @param named Указатель на именованную очередь.
+ */
+static void named_queue_put(struct named_queue *named) {
+    if (!refcount_dec_and_mutex_lock(&named->refs, &named_lock)) {
+        return;
+    }
+    // Каталог в debugfs удаляется вместе с записью в таблице, чтобы подключение, которое заново
+    // создает очередь с тем же именем, не наткнулось на старый каталог.
+    debugfs_remove(named->queue.debugfs);
+    named->queue.debugfs = NULL;
+    hash_del(&named->node);
+    mutex_unlock(&named_lock);
+
+    sber_info("sber_device: Destroyed queue %s\n", named->name);
+    queue_teardown(&named->queue);
+    kfree(named);
+}
+
+/**
+ * @brief Открывает устройство и инициализирует данные для очереди.
+ *
+ * @param inode Указатель на структуру inode.
+ * @param file Указатель на структуру файла, ассоциированную с устройством.
+ *
+ * В зависимости от режима экземпляра устройства `mode`, драйвер поддерживает:
+ * 1. Одиночный доступ (SINGLE_OPEN_MODE) с блокировкой параллельных открытий.
+ * 2. Параллельный доступ (MULTI_OPEN_MODE), создавая отдельную очередь для каждого вызова.
+ * 3. Общий режим (DEFAULT_MODE), где все процессы используют одну очередь.
+ *
+ * Режим читается один раз и запоминается в контексте дескриптора: смена режима через ioctl
+ * влияет только на последующие открытия, а чтение, запись и закрытие общий режим не читают.
+ *
+ * @return 0 при успешном открытии устройства, -EBUSY, если устройство занято, или -ENOMEM.
+ */
+static int device_open(struct inode *inode, struct file *file) {
+    struct queue_minor *minor = queue_minor_of(inode);
+    struct queue_device *queue_dev;
+    struct queue_file *qfile;
+    char name[32];
+    int mode;
+
+    qfile = kmalloc(sizeof(*qfile), GFP_KERNEL_ACCOUNT);
+    if (!qfile) {
+        queue_stat_error(&minor->queue, -ENOMEM);
+        return -ENOMEM;
+    }
+    mode = READ_ONCE(minor->mode);
+
+    if (mode == SINGLE_OPEN_MODE) {
+        if (test_and_set_bit_lock(MINOR_SINGLE_OPEN, &minor->flags)) {
+            sber_info("sber_device: Device is busy\n");
+            queue_stat_error(&minor->queue, -EBUSY);
+            kfree(qfile);
+            return -EBUSY;
+        }
+    }
+
+    if (mode == MULTI_OPEN_MODE) {
+        queue_dev = kzalloc(sizeof(struct queue_device), GFP_KERNEL_ACCOUNT);
+        if (!queue_dev || queue_dev_init(queue_dev)) {
+            queue_stat_error(&minor->queue, -ENOMEM);
+            kfree(queue_dev);
+            kfree(qfile);
+            return -ENOMEM;
+        }
+        queue_register(queue_dev);
+        snprintf(name, sizeof(name), "private%u", queue_dev->id);
+        queue_debugfs_add(queue_dev, name, queue_debugfs);
+    } else {
+        queue_dev = &minor->queue;
+    }
+    qfile->queue = queue_dev;
+    qfile->own = mode == MULTI_OPEN_MODE ? queue_dev : NULL;
+    qfile->named = NULL;
+    qfile->mode = mode;
+    qfile->polled = false;
+
+    if (file->f_mode & FMODE_READ) {
+        atomic_inc(&queue_dev->readers);
+    }
+    if (file->f_mode & FMODE_WRITE) {
+        atomic_inc(&queue_dev->writers);
+    }
+
+    file->private_data = qfile;
+    trace_sber_open(queue_dev->id, minor - minors, mode);
+
+    return 0;
+}
+
+/**
+ * @brief Освобождает ресурсы при закрытии устройства.
+ *
+ * @param inode Указатель на структуру inode.
+ * @param file Указатель на структуру файла, ассоциированную с устройством.
+ *
+ * Действует по режиму, в котором дескриптор был открыт, даже если режим экземпляра
+ * с тех пор сменили. Освобождает бит одиночного доступа. Если используется параллельный режим,
+ * освобождает очередь, выделенную для конкретного процесса, вместе с ее пулом, и отпускает
+ * именованную очередь, к которой был подключен дескриптор.
+ * Содержимое общей и именованной очереди сохраняется, а данные, извлеченные через дескриптор
+ * без подтверждения, возвращаются в ее голову. Ожидающие читатели и писатели будятся,
+ * чтобы проверить, не закрылся ли последний дескриптор противоположной стороны.
+ *
+ * @return 0 при успешном освобождении устройства.
+ */
+static int device_release(struct inode *inode, struct file *file) {
+    struct queue_minor *minor = queue_minor_of(inode);
+    struct queue_file *qfile = file->private_data;
+    struct queue_device *queue_dev = qfile->queue;
+
+    trace_sber_release(queue_dev->id, minor - minors, qfile->mode);
+    if (qfile->mode == SINGLE_OPEN_MODE) {
+        clear_bit_unlock(MINOR_SINGLE_OPEN, &minor->flags);
+    }
+
+    if (queue_dev != qfile->own) {
+        queue_requeue_pending(queue_dev, file);
+        if ((file->f_mode & FMODE_READ) && atomic_dec_and_test(&queue_dev->readers)) {
+            wake_up_interruptible_all(&queue_dev->write_wait);
+        }
+        if ((file->f_mode & FMODE_WRITE) && atomic_dec_and_test(&queue_dev->writers)) {
+            wake_up_interruptible_all(&queue_dev->read_wait);
+        }
+    }
+    if (qfile->named) {
+        named_queue_put(qfile->named);
+    }
+    if (qfile->own) {
+        queue_teardown(qfile->own);
+        kfree(qfile->own);
+    }
+    kfree(qfile);
+    return 0;
+}
+
+/**
+ * @brief Возвращает промежуточный буфер для копирования данных пользователя.
+ *
+ * @param onstack Буфер на стеке вызывающего размером STAGE_ONSTACK.
+ * @param size Требуемый размер буфера.
+ *
+ * @return onstack для небольших операций, буфер из kvmalloc для остальных или NULL.
+ */
+static char *stage_alloc(char *onstack, size_t size) {
+    if (size <= STAGE_ONSTACK) {
+        return onstack;
+    }
+    return kvmalloc(size, GFP_KERNEL_ACCOUNT);
+}
+
+/**
+ * @brief Освобождает буфер, полученный от stage_alloc.
+ *
+ * @param onstack Буфер на стеке, переданный в stage_alloc.
+ * @param stage Освобождаемый буфер.
+ */
+static void stage_free(char *onstack, char *stage) {
+    if (stage != onstack) {
+        kvfree(stage);
+    }
+}
+
+/**
+ * @brief Записывает данные в список сегментов очереди.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под `queue_dev->lock` на чтение.
+ * @param data Записываемые данные, уже скопированные из пространства пользователя.
+ * @param count Количество байт для записи.
+ * @param batch Пакет, из которого берутся новые сегменты.
+ *
+ * Данные, которые помещаются в хвостовой сегмент, дописываются в него под tail_lock.
+ * Иначе остаток хвостового сегмента заполняется началом данных, а остальные данные заранее
+ * раскладываются по новым сегментам без блокировок, и под tail_lock сегменты только добавляются
+ * в конец списка, поэтому под спин-блокировкой не выполняются ни выделение памяти, ни копирование
+ * больших объемов. Заполненная очередь занимает не больше queue_max_chunks() сегментов, на что
+ * рассчитаны резерв и кэш пула. Если, пока сегменты готовились, другой писатель занял остаток
+ * хвостового сегмента, сегменты возвращаются в пул и запись повторяется.
+ * Новые сегменты берутся из пула или пакетами из `chunk_cache`.
+ *
+ * @return Количество записанных байт или код ошибки.
+ */
+static ssize_t queue_list_write(struct queue_device *queue_dev, const char *data, size_t count,
+                                struct chunk_batch *batch) {
+    struct queue_chunk *chunk, *tmp;
+    LIST_HEAD(chunks);
+    size_t room;
+
+again:
+    spin_lock(&queue_dev->tail_lock);
+    if (count > queue_space(queue_dev, queue_list_len(queue_dev))) {
+        spin_unlock(&queue_dev->tail_lock);
+        return -ENOSPC;
+    }
+    // Читатель не удаляет последний сегмент, поэтому непустой список не опустеет под tail_lock.
+    room = 0;
+    if (!list_empty(&queue_dev->queue)) {
+        chunk = list_last_entry(&queue_dev->queue, struct queue_chunk, list);
+        room = chunk_size - chunk->tail;
+        if (count <= room) {
+            WRITE_ONCE(queue_dev->bytes_in, queue_dev->bytes_in + count);
+            memcpy(chunk->data + chunk->tail, data, count);
+            smp_store_release(&chunk->tail, chunk->tail + count);
+            spin_unlock(&queue_dev->tail_lock);
+            return count;
+        }
+    }
+    spin_unlock(&queue_dev->tail_lock);
+
+    if (queue_fill_chunks(queue_dev, &chunks, data + room, count - room, batch)) {
+        pr_err_ratelimited("sber_device: Memory allocation failed\n");
+        return -ENOMEM;
+    }
+
+    spin_lock(&queue_dev->tail_lock);
+    if (count > queue_space(queue_dev, queue_list_len(queue_dev))) {
+        spin_unlock(&queue_dev->tail_lock);
+        queue_put_chunks(queue_dev, &chunks, batch);
+        return -ENOSPC;
+    }
+    if (room) {
+        // Хвостовой сегмент мог смениться, но достаточно, чтобы в новом хвосте осталось не меньше места.
+        chunk = list_empty(&queue_dev->queue) ? NULL : list_last_entry(&queue_dev->queue, struct queue_chunk, list);
+        if (!chunk || chunk_size - chunk->tail < room) {
+            spin_unlock(&queue_dev->tail_lock);
+            queue_put_chunks(queue_dev, &chunks, batch);
+            goto again;
+        }
+    }
+    WRITE_ONCE(queue_dev->bytes_in, queue_dev->bytes_in + count);
+    if (room) {
+        memcpy(chunk->data + chunk->tail, data, room);
+        smp_store_release(&chunk->tail, chunk->tail + room);
+    }
+    list_for_each_entry_safe(chunk, tmp, &chunks, list) {
+        list_del(&chunk->list);
+        list_add_tail_rcu(&chunk->list, &queue_dev->queue);
+    }
+    spin_unlock(&queue_dev->tail_lock);
+    return count;
+}
+
+/**
+ * @brief Записывает данные в кольцевой буфер очереди.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под `queue_dev->ring_write_lock`.
+ * @param data Записываемые данные, уже скопированные из пространства пользователя.
+ * @param count Количество байт для записи.
+ *
+ * Читатель может только освобождать место в кольце, поэтому проверка заполненности
+ * без блокировки читателя не приводит к переполнению.
+ *
+ * @return Количество записанных байт или код ошибки.
+ */
+static ssize_t queue_ring_write(struct queue_device *queue_dev, const char *data, size_t count) {
+    if (count > queue_space(queue_dev, kfifo_len(&queue_dev->ring))) {
+        return -ENOSPC;
+    }
+
+    return kfifo_in(&queue_dev->ring, data, count);
+}
+
+/**
+ * @brief Выделяет запись под указанное количество байт.
+ *
+ * @param len Размер данных записи.
+ * @param node Узел NUMA для записи или NUMA_NO_NODE.
+ *
+ * @return Указатель на запись или NULL, если не удалось выделить память.
+ */
+static struct queue_record *queue_record_alloc(size_t len, int node) {
+    struct queue_record *record;
+
+    record = kvmalloc_node(struct_size(record, data, len), GFP_KERNEL_ACCOUNT, node);
+    if (record) {
+        record->len = len;
+        record->owner = NULL;
+        record->token = 0;
+    }
+    return record;
+}
+
+/**
+ * @brief Добавляет запись в конец списка записей очереди.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под `queue_dev->lock` на чтение.
+ * @param record Заранее выделенная и заполненная запись или NULL; при успехе
+ * запись переходит очереди и *record обнуляется.
+ * @param data Записываемые данные, если запись не выделена заранее.
+ * @param count Количество байт для записи.
+ *
+ * Запись выделяется заранее, когда разбиение включено до вызова write, и тогда
+ * данные пользователя копируются сразу в нее. Если разбиение включили позже,
+ * запись выделяется здесь из промежуточного буфера. Под tail_lock запись только
+ * добавляется в список; если места не оказалось, она остается у вызывающего.
+ *
+ * @return Количество записанных байт или код ошибки.
+ */
+static ssize_t queue_record_write(struct queue_device *queue_dev, struct queue_record **record,
+                                  const char *data, size_t count) {
+    if (count > queue_space(queue_dev, queue_list_len(queue_dev))) {
+        return -ENOSPC;
+    }
+
+    if (!*record) {
+        *record = queue_record_alloc(count, queue_alloc_node(queue_dev));
+        if (!*record) {
+            pr_err_ratelimited("sber_device: Memory allocation failed\n");
+            return -ENOMEM;
+        }
+        memcpy((*record)->data, data, count);
+    }
+
+    spin_lock(&queue_dev->tail_lock);
+    if (count > queue_space(queue_dev, queue_list_len(queue_dev))) {
+        spin_unlock(&queue_dev->tail_lock);
+        return -ENOSPC;
+    }
+    WRITE_ONCE(queue_dev->bytes_in, queue_dev->bytes_in + count);
+    queue_record_charge(queue_dev, *record);
+    list_add_tail_rcu(&(*record)->list, &queue_dev->records);
+    spin_unlock(&queue_dev->tail_lock);
+
+    *record = NULL;
+    return count;
+}
+
+/**
+ * @brief Возвращает порог переноса локальных частей счетчика shard_used в общую.
+ *
+ * @param queue_dev Указатель на очередь.
+ *
+ * Сверка с емкостью обходится без общей блокировки счетчика, пока заполнение дальше от емкости,
+ * чем порог на каждый процессор. Поэтому для небольших очередей порог уменьшается так, чтобы
+ * сумма порогов всех процессоров не превышала половины емкости.
+ */
+static s32 queue_shard_batch(const struct queue_device *queue_dev) {
+    size_t batch = READ_ONCE(queue_dev->capacity) / (2 * num_online_cpus());
+
+    return clamp_t(size_t, batch, 1, SHARD_BATCH);
+}
+
+/**
+ * @brief Записывает данные в шард текущего процессора.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под `queue_dev->engine_sem` на чтение.
+ * @param data Записываемые данные, уже скопированные из пространства пользователя.
+ * @param count Количество байт для записи.
+ *
+ * Место в очереди занимается в общем счетчике shard_used и возвращается, если емкость
+ * превышена, как lf_used у очереди без блокировок: пока до емкости далеко, меняется только
+ * локальная часть счетчика, и лишь вблизи емкости он суммируется по всем процессорам.
+ * Процессор выбирается без запрета вытеснения: если поток тут же переедет, данные
+ * просто окажутся в шарде соседнего процессора.
+ *
+ * @return Количество записанных байт или код ошибки.
+ */
+static ssize_t queue_shard_write(struct queue_device *queue_dev, const char *data, size_t count) {
+    s32 batch = queue_shard_batch(queue_dev);
+    struct queue_shard *shard;
+    struct shard_node *node;
+
+    node = kvmalloc_node(struct_size(node, data, count), GFP_KERNEL_ACCOUNT, queue_alloc_node(queue_dev));
+    if (!node) {
+        pr_err_ratelimited("sber_device: Memory allocation failed\n");
+        return -ENOMEM;
+    }
+
+    percpu_counter_add_batch(&queue_dev->shard_used, count, batch);
+    if (__percpu_counter_compare(&queue_dev->shard_used, queue_dev->capacity, batch) > 0) {
+        percpu_counter_add_batch(&queue_dev->shard_used, -(s64)count, batch);
+        kvfree(node);
+        return -ENOSPC;
+    }
+
+    node->head = 0;
+    node->len = count;
+    memcpy(node->data, data, count);
+
+    percpu_counter_add_local(&queue_dev->shard_mem, struct_size(node, data, count));
+    shard = raw_cpu_ptr(queue_dev->shards);
+    spin_lock(&shard->lock);
+    list_add_tail(&node->list, &shard->nodes);
+    spin_unlock(&shard->lock);
+    return count;
+}
+
+/**
+ * @brief Добавляет данные в хвост очереди без блокировок.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под `queue_dev->engine_sem` на чтение.
+ * @param data Записываемые данные, уже скопированные из пространства пользователя.
+ * @param count Количество байт для записи.
+ *
+ * Место в очереди занимается атомарным увеличением lf_used и возвращается, если емкость
+ * превышена. Новый узел присоединяется к последнему узлу через cmpxchg его next; отставший
+ * хвост любой писатель или читатель продвигает вперед, как в очереди Майкла-Скотта.
+ * Узлы, на которые смотрит писатель, не освобождаются до выхода из rcu_read_lock.
+ *
+ * @return Количество записанных байт или код ошибки.
+ */
+static ssize_t queue_lf_write(struct queue_device *queue_dev, const char *data, size_t count) {
+    struct lf_node *node, *tail, *next;
+
+    node = kvmalloc_node(struct_size(node, data, count), GFP_KERNEL_ACCOUNT, queue_alloc_node(queue_dev));
+    if (!node) {
+        pr_err_ratelimited("sber_device: Memory allocation failed\n");
+        return -ENOMEM;
+    }
+
+    if ((size_t)atomic_long_add_return(count, &queue_dev->lf_used) > queue_dev->capacity) {
+        atomic_long_sub(count, &queue_dev->lf_used);
+        kvfree(node);
+        return -ENOSPC;
+    }
+
+    node->next = NULL;
+    node->len = count;
+    atomic_long_set(&node->claimed, 0);
+    memcpy(node->data, data, count);
+    atomic_long_add(struct_size(node, data, count), &queue_dev->mem_used);
+
+    rcu_read_lock();
+    for (;;) {
+        tail = READ_ONCE(queue_dev->lf_tail);
+        next = smp_load_acquire(&tail->next);
+        if (tail != READ_ONCE(queue_dev->lf_tail)) {
+            continue;
+        }
+        if (next) {
+            cmpxchg(&queue_dev->lf_tail, tail, next);
+            continue;
+        }
+        // cmpxchg - полный барьер: содержимое узла становится видно раньше ссылки на него.
+        if (!cmpxchg(&tail->next, NULL, node)) {
+            cmpxchg(&queue_dev->lf_tail, tail, node);
+            break;
+        }
+    }
+    rcu_read_unlock();
+    return count;
+}
+
+/**
+ * @brief Записывает данные в очередь с учетом ее механизма хранения и разбиения.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под блокировкой писателя из queue_lock.
+ * @param engine Механизм хранения, возвращенный queue_lock.
+ * @param record Заранее выделенная запись или NULL, см. queue_record_write.
+ * @param data Записываемые данные, уже скопированные из пространства пользователя.
+ * @param count Количество байт для записи; пустая запись ничего не добавляет в очередь.
+ * @param batch Пакет, из которого берутся новые сегменты.
+ *
+ * @return Количество записанных байт или код ошибки.
+ */
+static ssize_t queue_write(struct queue_device *queue_dev, int engine, struct queue_record **record,
+                           const char *data, size_t count, struct chunk_batch *batch) {
+    if (!count) {
+        return 0;
+    }
+    if (engine == SBER_ENGINE_RING) {
+        return queue_ring_write(queue_dev, data, count);
+    }
+    if (engine == SBER_ENGINE_SHARD) {
+        return queue_shard_write(queue_dev, data, count);
+    }
+    if (engine == SBER_ENGINE_LOCKFREE) {
+        return queue_lf_write(queue_dev, data, count);
+    }
+    if (queue_dev->framing == SBER_FRAMING_RECORD) {
+        return queue_record_write(queue_dev, record, data, count);
+    }
+    return queue_list_write(queue_dev, data, count, batch);
+}
+
+/**
+ * @brief Ждет, пока в очереди освободится место под запись.
+ *
+ * @param queue_dev Указатель на очередь, вызывается без блокировок очереди.
+ * @param count Сколько байт нужно записать.
+ * @param nonblock true, если вызывающий не должен ждать.
+ *
+ * @return 0, если запись стоит повторить, -EAGAIN для неблокирующего вызова или -ERESTARTSYS.
+ */
+static int queue_wait_space(struct queue_device *queue_dev, size_t count, bool nonblock) {
+    if (nonblock) {
+        return -EAGAIN;
+    }
+    if (wait_event_interruptible(queue_dev->write_wait,
+                                 count <= queue_space(queue_dev, queue_len(queue_dev)) ||
+                                 !atomic_read(&queue_dev->readers))) {
+        return -ERESTARTSYS;
+    }
+    return 0;
+}
+
+/**
+ * @brief Записывает данные в очередь устройства (write, writev).
+ *
+ * @param iocb Описание операции, ki_filp указывает на файл устройства.
+ * @param from Итератор по буферам пользователя для записи.
+ *
+ * Копирует данные из пользовательских буферов в очередь устройства.
+ * Если данные больше емкости очереди, возвращает ошибку переполнения. Если очередь заполнена,
+ * ждет освобождения места, пока у очереди есть читатели; с O_NONBLOCK вместо ожидания возвращает
+ * -EAGAIN, а без читателей - ошибку переполнения. Буферы копируются вызовом `copy_from_iter`
+ * в промежуточный буфер до захвата блокировки, так что ошибки страниц не обрабатываются под
+ * блокировкой очереди, а запись writev до STAGE_WRITE_MAX байт попадает в очередь целиком
+ * за один захват блокировки. Больший поток, как запись в канал больше PIPE_BUF, ставится
+ * в очередь частями по STAGE_WRITE_MAX байт, между которыми могут вклиниться другие писатели;
+ * если часть поставить не удалось, вызов возвращает количество уже записанных байт.
+ * splice и sendfile в устройство
+ * приходят сюда через iter_file_splice_write с итератором по страницам канала, минуя пространство
+ * пользователя.
+ * В зависимости от механизма хранения очереди данные попадают в список сегментов
+ * или в кольцевой буфер. Невостребованные сегменты возвращаются в кэш после снятия блокировки.
+ * При разбиении на записи вызов целиком становится одной записью очереди, и промежуточным
+ * буфером служит сама запись. Пустая запись ничего не добавляет в очередь.
+ *
+ * @return Количество записанных байт, -ENOSPC в случае переполнения, -EAGAIN или -ERESTARTSYS.
+ */
+static ssize_t device_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    struct file *file = iocb->ki_filp;
+    struct queue_device *queue_dev = queue_of(file);
+    struct chunk_batch batch = { .nr = 0 };
+    struct queue_record *record = NULL;
+    size_t count = iov_iter_count(from);
+    char onstack[STAGE_ONSTACK];
+    size_t size, len, done;
+    bool nonblock;
+    int framing;
+    char *stage;
+    ssize_t ret;
+    int engine;
+
+    if (!count) {
+        return 0;
+    }
+    if (count > READ_ONCE(queue_dev->capacity)) {
+        if (trace_sber_overflow_enabled()) {
+            trace_sber_overflow(queue_dev->id, count, queue_occupancy(queue_dev), READ_ONCE(queue_dev->capacity));
+        }
+        queue_stat_write(queue_dev, -ENOSPC);
+        return -ENOSPC;
+    }
+
+    // Запись хранится в очереди целиком, поэтому ее буфер не ограничен STAGE_WRITE_MAX.
+    framing = READ_ONCE(queue_dev->framing);
+    if (framing == SBER_FRAMING_RECORD) {
+        size = count;
+        record = queue_record_alloc(count, queue_alloc_node(queue_dev));
+        stage = record ? record->data : NULL;
+    } else {
+        size = min_t(size_t, count, STAGE_WRITE_MAX);
+        stage = stage_alloc(onstack, size);
+    }
+    if (!stage) {
+        queue_stat_write(queue_dev, -ENOMEM);
+        queue_stat_error(queue_dev, -ENOMEM);
+        return -ENOMEM;
+    }
+
+    nonblock = (file->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+    for (done = 0; done < count; done += ret) {
+        len = min(size, count - done);
+        if (copy_from_iter(stage, len, from) != len) {
+            pr_err_ratelimited("sber_device: Failed to copy from user\n");
+            ret = -EFAULT;
+            break;
+        }
+
+        for (;;) {
+            engine = queue_lock(queue_dev, false);
+            ret = queue_write(queue_dev, engine, &record, stage, len, &batch);
+            queue_unlock(queue_dev, engine, false);
+
+            if (ret != -ENOSPC || !atomic_read(&queue_dev->readers)) {
+                break;
+            }
+            // Место под следующую часть освободят читатели уже поставленных частей.
+            if (done) {
+                wake_up_interruptible_poll(&queue_dev->read_wait, EPOLLIN | EPOLLRDNORM);
+            }
+            ret = queue_wait_space(queue_dev, len, nonblock);
+            if (ret) {
+                break;
+            }
+        }
+        if (ret <= 0) {
+            break;
+        }
+    }
+    chunk_batch_flush(&batch);
+    if (done) {
+        ret = done;
+    }
+
+    kvfree(record);
+    if (framing != SBER_FRAMING_RECORD) {
+        stage_free(onstack, stage);
+    }
+
+    if (ret > 0) {
+        wake_up_interruptible_poll(&queue_dev->read_wait, EPOLLIN | EPOLLRDNORM);
+        if (trace_sber_enqueue_enabled()) {
+            trace_sber_enqueue(queue_dev->id, ret, queue_occupancy(queue_dev));
+        }
+    } else if (ret == -ENOSPC || ret == -EAGAIN) {
+        if (trace_sber_overflow_enabled()) {
+            trace_sber_overflow(queue_dev->id, count, queue_occupancy(queue_dev), READ_ONCE(queue_dev->capacity));
+        }
+    }
+    queue_stat_write(queue_dev, ret);
+    queue_stat_error(queue_dev, ret);
+    return ret;
+}
+
+/**
+ * @brief Возвращает вычитанный последний сегмент в начало, чтобы писатель заполнял его заново.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под head_lock.
+ * @param chunk Первый сегмент очереди, в котором не осталось непрочитанных данных.
+ *
+ * В последний сегмент дописывает писатель, поэтому сегмент сбрасывается под tail_lock
+ * и только если писатель не успел дописать в него данные или добавить следующий сегмент.
+ */
+static void queue_list_rewind(struct queue_device *queue_dev, struct queue_chunk *chunk) {
+    spin_lock(&queue_dev->tail_lock);
+    if (chunk->head == chunk->tail && list_is_last(&chunk->list, &queue_dev->queue)) {
+        chunk->head = 0;
+        chunk->tail = 0;
+    }
+    spin_unlock(&queue_dev->tail_lock);
+}
+
+/**
+ * @brief Читает данные из списка сегментов очереди.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под `queue_dev->lock` на чтение.
+ * @param data Буфер для прочитанных данных.
+ * @param count Количество байт для чтения.
+ * @param batch Пакет сегментов на освобождение.
+ *
+ * Читатель работает под head_lock параллельно с писателем: границу данных сегмента tail
+ * и ссылку на следующий сегмент он читает с барьером acquire. Сегменты, которые вычитываются
+ * целиком и за которыми уже есть следующий, под head_lock только вынимаются из очереди,
+ * а копируются после ее снятия; под блокировкой копируется не больше одного сегмента, на котором
+ * чтение заканчивается. Полностью вычитанные сегменты освобождаются, кроме последнего: он
+ * переиспользуется для последующих записей, чтобы чередование записи и чтения не выделяло память
+ * каждый раз.
+ *
+ * @return Количество прочитанных байт.
+ */
+static size_t queue_list_read(struct queue_device *queue_dev, char *data, size_t count,
+                              struct chunk_batch *batch) {
+    unsigned long hits = 0, misses = 0;
+    struct list_head *first, *next;
+    struct queue_chunk *chunk, *tmp;
+    int nid = numa_node_id();
+    size_t read = 0, copied = 0;
+    size_t tail, len;
+    LIST_HEAD(taken);
+
+    spin_lock(&queue_dev->head_lock);
+    for (;;) {
+        first = smp_load_acquire(&queue_dev->queue.next);
+        if (first == &queue_dev->queue) {
+            break;
+        }
+        chunk = list_entry(first, struct queue_chunk, list);
+
+        // Сегмент, за которым уже есть следующий, писатель больше не меняет.
+        next = smp_load_acquire(&chunk->list.next);
+        tail = smp_load_acquire(&chunk->tail);
+        if (chunk->head < tail) {
+            if (read == count) {
+                break;
+            }
+            len = min(count - read, tail - chunk->head);
+            read += len;
+            if (queue_mem_node(chunk) == nid) {
+                hits++;
+            } else {
+                misses++;
+            }
+            if (next != &queue_dev->queue && len == tail - chunk->head) {
+                list_move_tail(&chunk->list, &taken);
+                continue;
+            }
+            // Последний или недочитанный сегмент остается в очереди, и чтение на нем заканчивается.
+            memcpy(data + read - len, chunk->data + chunk->head, len);
+            chunk->head += len;
+            if (chunk->head == tail && next == &queue_dev->queue) {
+                queue_list_rewind(queue_dev, chunk);
+            }
+            break;
+        }
+
+        if (next == &queue_dev->queue) {
+            if (tail) {
+                queue_list_rewind(queue_dev, chunk);
+            }
+            break;
+        }
+        list_del(&chunk->list);
+        queue_put_chunk(queue_dev, batch, chunk);
+    }
+    smp_store_release(&queue_dev->bytes_out, queue_dev->bytes_out + read);
+    spin_unlock(&queue_dev->head_lock);
+
+    // Вынутые из очереди сегменты стоят в начале прочитанного и принадлежат только этому читателю.
+    list_for_each_entry_safe(chunk, tmp, &taken, list) {
+        len = chunk->tail - chunk->head;
+        memcpy(data + copied, chunk->data + chunk->head, len);
+        copied += len;
+        list_del(&chunk->list);
+        queue_put_chunk(queue_dev, batch, chunk);
+    }
+
+    if (read) {
+        queue_numa_read(queue_dev, nid, hits, misses);
+    }
+    return read;
+}
+
+/**
+ * @brief Читает данные из кольцевого буфера очереди.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под `queue_dev->ring_read_lock`.
+ * @param data Буфер для прочитанных данных.
+ * @param count Количество байт для чтения.
+ *
+ * @return Количество прочитанных байт.
+ */
+static size_t queue_ring_read(struct queue_device *queue_dev, char *data, size_t count) {
+    return kfifo_out(&queue_dev->ring, data, count);
+}
+
+/**
+ * @brief Извлекает первую запись из списка записей очереди.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под `queue_dev->lock` на чтение.
+ * @param count Размер буфера читателя.
+ * @param record Извлеченная запись; после копирования данных ее освобождает вызывающий.
+ *
+ * Запись, за которой есть следующая, удаляется под head_lock параллельно с писателем,
+ * последняя запись - под обеими блокировками, так как писатель меняет ее ссылку next.
+ *
+ * @return Размер извлеченной записи, 0 для пустой очереди или -EMSGSIZE,
+ * если запись не помещается в буфер; такая запись остается в очереди.
+ */
+static ssize_t queue_record_read(struct queue_device *queue_dev, size_t count, struct queue_record **record) {
+    struct queue_record *first;
+    struct list_head *head;
+    ssize_t ret;
+    bool last;
+    int nid;
+
+    spin_lock(&queue_dev->head_lock);
+    head = smp_load_acquire(&queue_dev->records.next);
+    if (head == &queue_dev->records) {
+        ret = 0;
+        goto out;
+    }
+    first = list_entry(head, struct queue_record, list);
+    if (first->len > count) {
+        ret = -EMSGSIZE;
+        goto out;
+    }
+
+    last = smp_load_acquire(&first->list.next) == &queue_dev->records;
+    if (last) {
+        spin_lock(&queue_dev->tail_lock);
+    }
+    list_del(&first->list);
+    if (last) {
+        spin_unlock(&queue_dev->tail_lock);
+    }
+    smp_store_release(&queue_dev->bytes_out, queue_dev->bytes_out + first->len);
+    queue_record_uncharge(queue_dev, first);
+    *record = first;
+    ret = first->len;
+out:
+    spin_unlock(&queue_dev->head_lock);
+    if (ret > 0) {
+        nid = numa_node_id();
+        queue_numa_read(queue_dev, nid, queue_mem_node(first) == nid, queue_mem_node(first) != nid);
+    }
+    return ret;
+}
+
+/**
+ * @brief Забирает данные из одного шарда.
+ *
+ * @param shard Шард очереди.
+ * @param data Буфер для прочитанных данных.
+ * @param count Количество байт для чтения.
+ * @param done Список, в который переносятся полностью прочитанные элементы для освобождения.
+ *
+ * @return Количество прочитанных байт.
+ */
+static size_t queue_shard_drain(struct queue_shard *shard, char *data, size_t count, struct list_head *done) {
+    struct shard_node *node, *tmp;
+    size_t read = 0;
+    size_t len;
+
+    // Пустые шарды пропускаются без захвата их блокировки, чтобы не тянуть чужие строки кэша.
+    if (list_empty_careful(&shard->nodes)) {
+        return 0;
+    }
+
+    spin_lock(&shard->lock);
+    list_for_each_entry_safe(node, tmp, &shard->nodes, list) {
+        if (read == count) {
+            break;
+        }
+        len = min(count - read, node->len - node->head);
+        memcpy(data + read, node->data + node->head, len);
+        node->head += len;
+        read += len;
+        if (node->head == node->len) {
+            list_move_tail(&node->list, done);
+        }
+    }
+    spin_unlock(&shard->lock);
+    return read;
+}
+
+/**
+ * @brief Читает данные из шардов очереди.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под `queue_dev->engine_sem` на чтение.
+ * @param data Буфер для прочитанных данных.
+ * @param count Количество байт для чтения.
+ *
+ * Сначала забирает данные из шарда текущего процессора, затем, если их не хватило,
+ * из шардов остальных процессоров по кругу начиная со следующего.
+ *
+ * @return Количество прочитанных байт.
+ */
+static size_t queue_shard_read(struct queue_device *queue_dev, char *data, size_t count) {
+    unsigned int this_cpu = raw_smp_processor_id();
+    struct shard_node *node, *tmp;
+    LIST_HEAD(done);
+    unsigned int cpu, i;
+    unsigned long hits = 0, misses = 0;
+    int nid = numa_node_id();
+    s64 freed = 0;
+    size_t read;
+
+    read = queue_shard_drain(per_cpu_ptr(queue_dev->shards, this_cpu), data, count, &done);
+    for (i = 1; i < nr_cpu_ids && read < count; i++) {
+        cpu = (this_cpu + i) % nr_cpu_ids;
+        if (cpu_possible(cpu)) {
+            read += queue_shard_drain(per_cpu_ptr(queue_dev->shards, cpu), data + read, count - read, &done);
+        }
+    }
+
+    if (read) {
+        percpu_counter_add_batch(&queue_dev->shard_used, -(s64)read, queue_shard_batch(queue_dev));
+    }
+    list_for_each_entry_safe(node, tmp, &done, list) {
+        if (queue_mem_node(node) == nid) {
+            hits++;
+        } else {
+            misses++;
+        }
+        freed += struct_size(node, data, node->len);
+        kvfree(node);
+    }
+    if (freed) {
+        percpu_counter_add_local(&queue_dev->shard_mem, -freed);
+    }
+    if (read) {
+        queue_numa_read(queue_dev, nid, hits, misses);
+    }
+    return read;
+}
+
+/**
+ * @brief Забирает данные из головы очереди без блокировок.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под `queue_dev->engine_sem` на чтение.
+ * @param data Буфер для прочитанных данных.
+ * @param count Количество байт для чтения.
+ *
+ * Голова очереди - фиктивный узел, данные начинаются со следующего за ним. Читатель занимает
+ * байты этого узла cmpxchg на его claimed и копирует их; полностью занятый узел становится
+ * новым фиктивным, когда кто-то сдвигает на него голову, а прежний фиктивный узел
+ * освобождается через kvfree_rcu. Поэтому занятые байты можно копировать, даже если голову
+ * уже сдвинули: узел не освободится, пока читатель не выйдет из rcu_read_lock. Каждый байт
+ * занимается ровно один раз, а один читатель получает данные в порядке записи.
+ *
+ * @return Количество прочитанных байт.
+ */
+static size_t queue_lf_read(struct queue_device *queue_dev, char *data, size_t count) {
+    unsigned long hits = 0, misses = 0;
+    struct lf_node *head, *tail, *next;
+    int nid = numa_node_id();
+    size_t read = 0;
+    long claimed;
+    size_t len;
+
+    rcu_read_lock();
+    while (read < count) {
+        head = READ_ONCE(queue_dev->lf_head);
+        tail = READ_ONCE(queue_dev->lf_tail);
+        next = smp_load_acquire(&head->next);
+        if (head != READ_ONCE(queue_dev->lf_head)) {
+            continue;
+        }
+        if (!next) {
+            break;
+        }
+        if (head == tail) {
+            cmpxchg(&queue_dev->lf_tail, tail, next);
+            continue;
+        }
+
+        claimed = atomic_long_read(&next->claimed);
+        if ((size_t)claimed >= next->len) {
+            if (cmpxchg(&queue_dev->lf_head, head, next) == head) {
+                atomic_long_sub(struct_size(head, data, head->len), &queue_dev->mem_used);
+                kvfree_rcu(head, rcu);
+            }
+            continue;
+        }
+
+        len = min_t(size_t, count - read, next->len - claimed);
+        if (atomic_long_try_cmpxchg(&next->claimed, &claimed, claimed + len)) {
+            memcpy(data + read, next->data + claimed, len);
+            read += len;
+            if (queue_mem_node(next) == nid) {
+                hits++;
+            } else {
+                misses++;
+            }
+        }
+    }
+    rcu_read_unlock();
+
+    if (read) {
+        atomic_long_sub(read, &queue_dev->lf_used);
+        queue_numa_read(queue_dev, nid, hits, misses);
+    }
+    return read;
+}
+
+/**
+ * @brief Читает поток байт из очереди с учетом ее механизма хранения.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под блокировкой читателя из queue_lock.
+ * @param engine Механизм хранения, возвращенный queue_lock.
+ * @param data Буфер для прочитанных данных.
+ * @param count Количество байт для чтения.
+ * @param batch Пакет сегментов на освобождение.
+ *
+ * @return Количество прочитанных байт.
+ */
+static size_t queue_read(struct queue_device *queue_dev, int engine, char *data, size_t count,
+                         struct chunk_batch *batch) {
+    if (engine == SBER_ENGINE_RING) {
+        return queue_ring_read(queue_dev, data, count);
+    }
+    if (engine == SBER_ENGINE_SHARD) {
+        return queue_shard_read(queue_dev, data, count);
+    }
+    if (engine == SBER_ENGINE_LOCKFREE) {
+        return queue_lf_read(queue_dev, data, count);
+    }
+    return queue_list_read(queue_dev, data, count, batch);
+}
+
+/**
+ * @brief Ждет появления данных в очереди.
+ *
+ * @param queue_dev Указатель на очередь, вызывается без блокировок очереди.
+ * @param nonblock true, если вызывающий не должен ждать.
+ *
+ * @return 0, если чтение стоит повторить, -EAGAIN для неблокирующего вызова или -ERESTARTSYS.
+ */
+static int queue_wait_data(struct queue_device *queue_dev, bool nonblock) {
+    if (nonblock) {
+        return -EAGAIN;
+    }
+    if (wait_event_interruptible(queue_dev->read_wait,
+                                 queue_len(queue_dev) || !atomic_read(&queue_dev->writers))) {
+        return -ERESTARTSYS;
+    }
+    return 0;
+}
+
+/**
+ * @brief Читает данные из очереди устройства (read, readv).
+ *
+ * @param iocb Описание операции, ki_filp указывает на файл устройства.
+ * @param to Итератор по буферам пользователя для чтения.
+ *
+ * Извлекает данные из очереди устройства и копирует их в буферы пользователя,
+ * удаляя прочитанные элементы из очереди. Если данных недостаточно, возвращает
+ * количество прочитанных байт, но не больше STAGE_READ_MAX за вызов. Если очередь пуста,
+ * ждет данных, пока у очереди есть писатели (с O_NONBLOCK возвращает -EAGAIN); без писателей
+ * возвращает 0, как конец файла. Данные извлекаются
+ * в промежуточный буфер за один захват блокировки и раскладываются по буферам пользователя
+ * одним вызовом `copy_to_iter` после ее снятия. Буфер пользователя подгружается до извлечения,
+ * а если копирование все же не удалось, непереданные данные списка сегментов и записей
+ * возвращаются в голову очереди; у остальных механизмов они теряются. Вычитанные сегменты
+ * списка освобождаются пакетами после снятия блокировки.
+ * splice и sendfile из устройства приходят сюда через copy_splice_read с итератором
+ * по страницам канала.
+ * При разбиении на записи вызов возвращает ровно одну запись целиком, копируя ее
+ * из самой записи без промежуточного буфера, или -EMSGSIZE, если запись не помещается в буфер.
+ *
+ * @return Количество прочитанных байт или ошибку в случае неудачи.
+ */
+static ssize_t device_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    struct file *file = iocb->ki_filp;
+    struct queue_device *queue_dev = queue_of(file);
+    struct chunk_batch batch = { .nr = 0 };
+    struct queue_record *record = NULL;
+    char onstack[STAGE_ONSTACK];
+    LIST_HEAD(records);
+    char *stage = NULL;
+    size_t count, copied;
+    bool framed;
+    ssize_t ret;
+    int engine;
+
+    if (!iov_iter_count(to)) {
+        return 0;
+    }
+
+    // Записи копируются пользователю напрямую, поэтому промежуточный буфер нужен только потоку байт.
+    count = min3(iov_iter_count(to), READ_ONCE(queue_dev->capacity), (size_t)STAGE_READ_MAX);
+    if (count && fault_in_iov_iter_writeable(to, count) == count) {
+        return -EFAULT;
+    }
+    if (READ_ONCE(queue_dev->framing) != SBER_FRAMING_RECORD) {
+        stage = stage_alloc(onstack, count);
+        if (!stage) {
+            queue_stat_error(queue_dev, -ENOMEM);
+            return -ENOMEM;
+        }
+    }
+
+    for (;;) {
+        engine = queue_lock(queue_dev, true);
+        if (engine == SBER_ENGINE_LIST && queue_dev->framing == SBER_FRAMING_RECORD) {
+            ret = queue_record_read(queue_dev, iov_iter_count(to), &record);
+        } else if (!stage) {
+            // Разбиение на записи выключили после входа в вызов.
+            queue_unlock(queue_dev, engine, true);
+            stage = stage_alloc(onstack, count);
+            if (!stage) {
+                queue_stat_error(queue_dev, -ENOMEM);
+                return -ENOMEM;
+            }
+            continue;
+        } else {
+            ret = queue_read(queue_dev, engine, stage, count, &batch);
+        }
+        queue_unlock(queue_dev, engine, true);
+
+        if (ret || !count || !atomic_read(&queue_dev->writers)) {
+            break;
+        }
+        ret = queue_wait_data(queue_dev, (file->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT));
+        if (ret) {
+            break;
+        }
+    }
+    chunk_batch_flush(&batch);
+    framed = record;
+
+    if (ret > 0) {
+        wake_up_interruptible_poll(&queue_dev->write_wait, EPOLLOUT | EPOLLWRNORM);
+        if (trace_sber_dequeue_enabled()) {
+            trace_sber_dequeue(queue_dev->id, ret, queue_occupancy(queue_dev));
+        }
+        copied = copy_to_iter(record ? record->data : stage, ret, to);
+        if (copied != (size_t)ret) {
+            pr_err_ratelimited("sber_device: Failed to copy to user\n");
+            // Запись передается только целиком, а из потока возвращается только непереданный остаток.
+            if (record) {
+                list_add(&record->list, &records);
+                if (!queue_unread(queue_dev, &records, NULL, 0)) {
+                    record = NULL;
+                }
+                ret = -EFAULT;
+            } else {
+                if (queue_unread(queue_dev, NULL, stage + copied, ret - copied)) {
+                    pr_err_ratelimited("sber_device: Lost %zu bytes\n", ret - copied);
+                }
+                ret = copied ? copied : -EFAULT;
+            }
+        }
+    }
+    // Запись возвращается целиком, поэтому коротким считается только чтение без записи.
+    queue_stat_read(queue_dev, ret, framed && ret > 0 ? ret : count);
+    kvfree(record);
+    stage_free(onstack, stage);
+    return ret;
+}
+
+/**
+ * @brief Сообщает готовность очереди к чтению и записи для poll, select и epoll.
+ *
+ * @param file Указатель на структуру файла, ассоциированную с устройством.
+ * @param wait Таблица ожидания poll.
+ *
+ * Дескриптор отмечается как ожидавший: регистрация epoll остается в очередях ожидания
+ * этой очереди, поэтому подключить его к именованной очереди после этого нельзя.
+ *
+ * Как у канала, дескриптор на чтение без писателей очереди получает EPOLLHUP вместе с EPOLLIN
+ * (read вернет конец файла, не ожидая), а дескриптор на запись без читателей - EPOLLERR вместе
+ * с EPOLLOUT (запись в заполненную очередь сразу вернет -ENOSPC).
+ *
+ * @return EPOLLIN, если в очереди есть данные, и EPOLLOUT, если в ней есть свободное место.
+ */
+static __poll_t device_poll(struct file *file, poll_table *wait) {
+    struct queue_file *qfile = file->private_data;
+    struct queue_device *queue_dev;
+    __poll_t mask = 0;
+    size_t len;
+
+    if (!READ_ONCE(qfile->polled)) {
+        WRITE_ONCE(qfile->polled, true);
+    }
+    queue_dev = queue_of(file);
+
+    poll_wait(file, &queue_dev->read_wait, wait);
+    poll_wait(file, &queue_dev->write_wait, wait);
+
+    len = queue_len(queue_dev);
+    if (len) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    if (queue_space(queue_dev, len)) {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+    if ((file->f_mode & FMODE_READ) && !atomic_read(&queue_dev->writers)) {
+        mask |= EPOLLIN | EPOLLRDNORM | EPOLLHUP;
+    }
+    if ((file->f_mode & FMODE_WRITE) && !atomic_read(&queue_dev->readers)) {
+        mask |= EPOLLOUT | EPOLLWRNORM | EPOLLERR;
+    }
+    return mask;
+}
+
+static void queue_vm_open(struct vm_area_struct *vma) {
+    struct queue_device *queue_dev = vma->vm_private_data;
+
+    atomic_inc(&queue_dev->mmap_count);
+}
+
+static void queue_vm_close(struct vm_area_struct *vma) {
+    struct queue_device *queue_dev = vma->vm_private_data;
+
+    atomic_dec(&queue_dev->mmap_count);
+}
+
+/**
+ * @brief Отображает в процесс одну страницу обычного кольца.
+ *
+ * @param vmf Описание отказа страницы; vmf->pgoff - смещение в кольце в страницах.
+ */
+static vm_fault_t queue_vm_fault(struct vm_fault *vmf) {
+    struct queue_device *queue_dev = vmf->vma->vm_private_data;
+    size_t offset = (size_t)vmf->pgoff << PAGE_SHIFT;
+    struct page *page;
+
+    if (offset >= kfifo_size(&queue_dev->ring)) {
+        return VM_FAULT_SIGBUS;
+    }
+    page = vmalloc_to_page((char *)queue_dev->ring_buf + offset);
+    get_page(page);
+    vmf->page = page;
+    return 0;
+}
+
+static const struct vm_operations_struct queue_vm_ops = {
+    .open = queue_vm_open,
+    .close = queue_vm_close,
+    .fault = queue_vm_fault,
+};
+
+/**
+ * @brief Отображает в процесс одну страницу кольца из больших страниц.
+ *
+ * @param vmf Описание отказа страницы; vmf->pgoff - смещение в кольце в страницах.
+ */
+static vm_fault_t queue_huge_vm_fault(struct vm_fault *vmf) {
+    struct queue_device *queue_dev = vmf->vma->vm_private_data;
+    size_t offset = (size_t)vmf->pgoff << PAGE_SHIFT;
+    struct page *page;
+
+    if (offset >= kfifo_size(&queue_dev->ring)) {
+        return VM_FAULT_SIGBUS;
+    }
+    page = nth_page(queue_dev->ring_huge[offset >> PMD_SHIFT], (offset & ~PMD_MASK) >> PAGE_SHIFT);
+    return vmf_insert_pfn(vmf->vma, vmf->address, page_to_pfn(page));
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/**
+ * @brief Отображает в процесс большую страницу кольца одной записью PMD.
+ *
+ * @param vmf Описание отказа страницы.
+ * @param order Порядок отображения, которое предлагает ядро.
+ *
+ * Если область процесса или смещение в кольце не выровнены на PMD_SIZE, ядро
+ * отображает страницы по одной через queue_huge_vm_fault.
+ */
+static vm_fault_t queue_huge_vm_huge_fault(struct vm_fault *vmf, unsigned int order) {
+    struct vm_area_struct *vma = vmf->vma;
+    struct queue_device *queue_dev = vma->vm_private_data;
+    unsigned long addr = vmf->address & PMD_MASK;
+    size_t offset;
+
+    if (order != PMD_ORDER || addr < vma->vm_start || addr + PMD_SIZE > vma->vm_end) {
+        return VM_FAULT_FALLBACK;
+    }
+    offset = (addr - vma->vm_start) + ((size_t)vma->vm_pgoff << PAGE_SHIFT);
+    if ((offset & ~PMD_MASK) || offset + PMD_SIZE > kfifo_size(&queue_dev->ring)) {
+        return VM_FAULT_FALLBACK;
+    }
+    return vmf_insert_pfn_pmd(vmf, pfn_to_pfn_t(page_to_pfn(queue_dev->ring_huge[offset >> PMD_SHIFT])), false);
+}
+#endif
+
+static const struct vm_operations_struct queue_huge_vm_ops = {
+    .open = queue_vm_open,
+    .close = queue_vm_close,
+    .fault = queue_huge_vm_fault,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+    .huge_fault = queue_huge_vm_huge_fault,
+#endif
+};
+
+/**
+ * @brief Отображает кольцевой буфер очереди в память процесса только для чтения.
+ *
+ * @param file Указатель на структуру файла, ассоциированную с устройством.
+ * @param vma Область памяти процесса, начиная с нулевого смещения.
+ *
+ * Отображение доступно только для очереди с механизмом хранения SBER_ENGINE_RING:
+ * сегменты списка выделяются из slab-кэша и не образуют непрерывного окна.
+ * Потребитель узнает границы данных через SBER_IOC_GET_WINDOW, обрабатывает их
+ * на месте и продвигает голову очереди через SBER_IOC_CONSUME. Пока отображение
+ * существует, механизм хранения очереди нельзя сменить, а кольцо - перевыделить.
+ * Кольцо из больших страниц отображается при обращении к нему, большими страницами там,
+ * где область процесса выровнена на PMD_SIZE; выравнивание подбирает get_unmapped_area.
+ *
+ * @return 0 при успехе, -EPERM для отображения на запись, -ENODEV для очереди
+ * без кольцевого буфера или -EINVAL для области больше кольца.
+ */
+static int device_mmap(struct file *file, struct vm_area_struct *vma) {
+    struct queue_device *queue_dev = queue_of(file);
+    int ret = 0;
+
+    if (vma->vm_flags & VM_WRITE) {
+        return -EPERM;
+    }
+
+    mutex_lock(&queue_dev->ring_read_lock);
+    if (queue_dev->engine != SBER_ENGINE_RING) {
+        ret = -ENODEV;
+        goto out;
+    }
+
+    if (vma->vm_pgoff + vma_pages(vma) > kfifo_size(&queue_dev->ring) >> PAGE_SHIFT) {
+        ret = -EINVAL;
+        goto out;
+    }
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+    if (queue_dev->ring_huge) {
+        vm_flags_set(vma, VM_PFNMAP | VM_HUGEPAGE);
+        vma->vm_ops = &queue_huge_vm_ops;
+    } else {
+        vma->vm_ops = &queue_vm_ops;
+    }
+
+    vm_flags_clear(vma, VM_MAYWRITE);
+    vma->vm_private_data = queue_dev;
+    queue_vm_open(vma);
+out:
+    mutex_unlock(&queue_dev->ring_read_lock);
+    return ret;
+}
+
+/**
+ * @brief Возвращает границы данных кольцевого буфера для потребителя, отобразившего его в память.
+ *
+ * @param queue_dev Указатель на очередь.
+ * @param uwindow Указатель на структуру sber_window в пространстве пользователя.
+ *
+ * @return 0 при успехе, -ENODEV для очереди без кольцевого буфера или -EFAULT.
+ */
+static int queue_get_window(struct queue_device *queue_dev, struct sber_window __user *uwindow) {
+    struct sber_window window;
+
+    mutex_lock(&queue_dev->ring_read_lock);
+    if (queue_dev->engine != SBER_ENGINE_RING) {
+        mutex_unlock(&queue_dev->ring_read_lock);
+        return -ENODEV;
+    }
+
+    window.size = kfifo_size(&queue_dev->ring);
+    window.len = kfifo_len(&queue_dev->ring);
+    window.head = queue_dev->ring.kfifo.out & queue_dev->ring.kfifo.mask;
+    window.tail = (window.head + window.len) & queue_dev->ring.kfifo.mask;
+    // Данные до tail должны быть видны потребителю раньше, чем он узнает новую границу.
+    smp_rmb();
+    mutex_unlock(&queue_dev->ring_read_lock);
+
+    return copy_to_user(uwindow, &window, sizeof(window)) ? -EFAULT : 0;
+}
+
+/**
+ * @brief Продвигает голову кольцевого буфера после обработки данных на месте.
+ *
+ * @param queue_dev Указатель на очередь.
+ * @param bytes Сколько байт потребитель обработал.
+ *
+ * @return 0 при успехе, -ENODEV для очереди без кольцевого буфера или -EINVAL,
+ * если в очереди меньше данных.
+ */
+static int queue_consume(struct queue_device *queue_dev, u64 bytes) {
+    int ret = 0;
+
+    mutex_lock(&queue_dev->ring_read_lock);
+    if (queue_dev->engine != SBER_ENGINE_RING) {
+        ret = -ENODEV;
+    } else if (bytes > kfifo_len(&queue_dev->ring)) {
+        ret = -EINVAL;
+    } else {
+        kfifo_skip_count(&queue_dev->ring, bytes);
+    }
+    mutex_unlock(&queue_dev->ring_read_lock);
+
+    if (!ret) {
+        wake_up_interruptible_poll(&queue_dev->write_wait, EPOLLOUT | EPOLLWRNORM);
+    }
+    return ret;
+}
+
+/**
+ * @brief Ставит в очередь пакет сообщений за один захват блокировки (SBER_IOC_ENQUEUE_BATCH).
+ *
+ * @param file Указатель на структуру файла, ассоциированную с устройством.
+ * @param ubatch Описание пакета в пространстве пользователя.
+ *
+ * Данные всех сообщений копируются в один промежуточный буфер до захвата блокировки,
+ * после чего сообщения записываются по порядку, пока очередь их принимает. При разбиении
+ * на записи каждое сообщение становится отдельной записью. В вызов входят только сообщения,
+ * которые вместе помещаются в емкость очереди и в STAGE_WRITE_MAX байт; первое сообщение
+ * ограничено только емкостью. Если не удалось поставить ни одного сообщения,
+ * вызов ждет места так же, как write.
+ *
+ * @return Количество поставленных сообщений или код ошибки, если не поставлено ни одного.
+ */
+static long queue_enqueue_batch(struct file *file, struct sber_batch __user *ubatch) {
+    struct queue_device *queue_dev = queue_of(file);
+    struct chunk_batch batch = { .nr = 0 };
+    struct queue_record *record = NULL;
+    size_t capacity = READ_ONCE(queue_dev->capacity);
+    char onstack[STAGE_ONSTACK];
+    struct sber_batch hdr;
+    struct sber_msg *msgs;
+    unsigned int nr, done = 0, i;
+    size_t total = 0, offset;
+    char *stage;
+    ssize_t ret = 0;
+    int engine;
+
+    if (copy_from_user(&hdr, ubatch, sizeof(hdr))) {
+        return -EFAULT;
+    }
+    if (!hdr.vlen) {
+        return 0;
+    }
+
+    nr = min_t(u32, hdr.vlen, SBER_BATCH_MAX);
+    msgs = memdup_array_user(u64_to_user_ptr(hdr.msgs), nr, sizeof(*msgs));
+    if (IS_ERR(msgs)) {
+        return PTR_ERR(msgs);
+    }
+
+    for (i = 0; i < nr && msgs[i].len <= capacity - total; i++) {
+        if (i && total + msgs[i].len > STAGE_WRITE_MAX) {
+            break;
+        }
+        total += msgs[i].len;
+    }
+    nr = i;
+    if (!nr) {
+        if (trace_sber_overflow_enabled()) {
+            trace_sber_overflow(queue_dev->id, msgs[0].len, queue_occupancy(queue_dev), capacity);
+        }
+        queue_stat_write(queue_dev, -ENOSPC);
+        kfree(msgs);
+        return -ENOSPC;
+    }
+
+    stage = stage_alloc(onstack, total);
+    if (!stage) {
+        kfree(msgs);
+        return -ENOMEM;
+    }
+
+    for (i = 0, offset = 0; i < nr; offset += msgs[i].len, i++) {
+        if (copy_from_user(stage + offset, u64_to_user_ptr(msgs[i].buf), msgs[i].len)) {
+            break;
+        }
+    }
+    nr = i;
+    if (!nr) {
+        pr_err_ratelimited("sber_device: Failed to copy from user\n");
+        ret = -EFAULT;
+        goto out;
+    }
+
+    offset = 0;
+    for (;;) {
+        engine = queue_lock(queue_dev, false);
+        for (; done < nr; done++) {
+            ret = queue_write(queue_dev, engine, &record, stage + offset, msgs[done].len, &batch);
+            if (ret < 0) {
+                break;
+            }
+            offset += msgs[done].len;
+        }
+        queue_unlock(queue_dev, engine, false);
+
+        if (done || ret != -ENOSPC || !atomic_read(&queue_dev->readers)) {
+            break;
+        }
+        ret = queue_wait_space(queue_dev, msgs[0].len, file->f_flags & O_NONBLOCK);
+        if (ret) {
+            break;
+        }
+    }
+    chunk_batch_flush(&batch);
+    kvfree(record);
+
+    queue_stat_write(queue_dev, done ? offset : ret);
+    if (done) {
+        wake_up_interruptible_poll(&queue_dev->read_wait, EPOLLIN | EPOLLRDNORM);
+        if (trace_sber_enqueue_enabled()) {
+            trace_sber_enqueue(queue_dev->id, offset, queue_occupancy(queue_dev));
+        }
+        ret = done;
+    } else if (ret == -ENOSPC || ret == -EAGAIN) {
+        if (trace_sber_overflow_enabled()) {
+            trace_sber_overflow(queue_dev->id, msgs[0].len, queue_occupancy(queue_dev), capacity);
+        }
+    }
+out:
+    stage_free(onstack, stage);
+    kfree(msgs);
+    return ret;
+}
+
+/**
+ * @brief Извлекает из очереди записи по одной на каждое описание пакета.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под `queue_dev->lock` на чтение.
+ * @param msgs Описания сообщений; в copied записывается размер извлеченной записи.
+ * @param nr Количество описаний.
+ * @param taken Список, в который переносятся извлеченные записи.
+ *
+ * @return Количество извлеченных записей, 0 для пустой очереди или -EMSGSIZE,
+ * если первая запись не помещается в первый буфер.
+ */
+static ssize_t queue_record_read_batch(struct queue_device *queue_dev, struct sber_msg *msgs, unsigned int nr,
+                                       struct list_head *taken) {
+    struct queue_record *record;
+    ssize_t len = 0;
+    unsigned int i;
+
+    for (i = 0; i < nr; i++) {
+        len = queue_record_read(queue_dev, msgs[i].len, &record);
+        if (len <= 0) {
+            break;
+        }
+        list_add_tail(&record->list, taken);
+        msgs[i].copied = len;
+    }
+    return i ? i : len;
+}
+
+/**
+ * @brief Копирует извлеченные записи в буферы пакета и освобождает скопированные.
+ *
+ * @param msgs Описания сообщений.
+ * @param taken Список записей, извлеченных queue_record_read_batch.
+ *
+ * Копирование останавливается на первой ошибке; эта и следующие записи остаются в taken
+ * в исходном порядке.
+ *
+ * @return Количество скопированных записей.
+ */
+static unsigned int queue_copy_records(struct sber_msg *msgs, struct list_head *taken) {
+    struct queue_record *record, *next;
+    unsigned int done = 0;
+
+    list_for_each_entry_safe(record, next, taken, list) {
+        if (copy_to_user(u64_to_user_ptr(msgs[done].buf), record->data, record->len)) {
+            break;
+        }
+        list_del(&record->list);
+        kvfree(record);
+        done++;
+    }
+    return done;
+}
 
-// Описывает устройство-очередь, содержит список для хранения элементов очереди, синхронизирующий
-struct queue_device {
-    struct list_head queue;
-    struct rw_semaphore lock;
-    int data_size;
-};
+/**
+ * @brief Раскладывает прочитанный поток байт по буферам пакета по порядку.
+ *
+ * @param msgs Описания сообщений; в copied записывается количество байт в буфере.
+ * @param nr Количество описаний.
+ * @param stage Прочитанные данные.
+ * @param count Количество прочитанных байт.
+ *
+ * @return Количество заполненных буферов.
+ */
+static unsigned int queue_copy_stage(struct sber_msg *msgs, unsigned int nr, const char *stage, size_t count) {
+    unsigned int done;
+    size_t offset = 0;
+    size_t len;
 
-static struct queue_device default_queue;
+    for (done = 0; done < nr && offset < count; done++) {
+        len = min_t(size_t, msgs[done].len, count - offset);
+        if (copy_to_user(u64_to_user_ptr(msgs[done].buf), stage + offset, len)) {
+            break;
+        }
+        msgs[done].copied = len;
+        offset += len;
+    }
+    return done;
+}
 
 /**
- * @brief Открывает устройство и инициализирует данные для очереди.
+ * @brief Извлекает из очереди пакет сообщений за один захват блокировки (SBER_IOC_DEQUEUE_BATCH).
  *
- * @param inode Указатель на структуру inode.
  * @param file Указатель на структуру файла, ассоциированную с устройством.
+ * @param ubatch Описание пакета в пространстве пользователя.
  *
- * В зависимости от установленного режима `device_mode`, драйвер поддерживает:
- * 1. Одиночный доступ (SINGLE_OPEN_MODE) с блокировкой параллельных открытий.
- * 2. Параллельный доступ (MULTI_OPEN_MODE), создавая отдельную очередь для каждого вызова.
- * 3. Общий режим (DEFAULT_MODE), где все процессы используют одну очередь.
+ * При разбиении на записи каждый буфер получает одну запись целиком; извлечение
+ * останавливается на записи, которая не помещается в очередной буфер. Поток байт
+ * раскладывается по буферам по порядку, как при readv, но не больше STAGE_READ_MAX за вызов.
+ * Размер данных в каждом буфере записывается в поле copied его описания. Пустая
+ * очередь обрабатывается так же, как в read. Если буфер не удалось заполнить, данные
+ * для него и следующих буферов возвращаются в голову очереди (для списка сегментов и записей),
+ * а вызов, как recvmmsg, сообщает о заполненных до ошибки буферах.
  *
- * @return 0 при успешном открытии устройства или -EBUSY, если устройство занято.
+ * @return Количество заполненных буферов, 0 без писателей или код ошибки.
  */
-static int device_open(struct inode *inode, struct file *file) {
-    struct queue_device *queue_dev;
+static long queue_dequeue_batch(struct file *file, struct sber_batch __user *ubatch) {
+    struct queue_device *queue_dev = queue_of(file);
+    struct chunk_batch batch = { .nr = 0 };
+    char onstack[STAGE_ONSTACK];
+    struct sber_batch hdr;
+    struct queue_record *record, *next;
+    struct sber_msg *msgs;
+    LIST_HEAD(taken);
+    unsigned int nr, done, i;
+    char *stage = NULL;
+    bool framed = false;
+    size_t count, copied;
+    u64 total = 0;
+    ssize_t ret;
+    int engine;
 
-    if (device_mode == SINGLE_OPEN_MODE) {
-        if (!mutex_trylock(&single_open_lock)) {
-            pr_info("sber_device: Device is busy\n");
-            return -EBUSY;
+    if (copy_from_user(&hdr, ubatch, sizeof(hdr))) {
+        return -EFAULT;
+    }
+    if (!hdr.vlen) {
+        return 0;
+    }
+
+    nr = min_t(u32, hdr.vlen, SBER_BATCH_MAX);
+    msgs = memdup_array_user(u64_to_user_ptr(hdr.msgs), nr, sizeof(*msgs));
+    if (IS_ERR(msgs)) {
+        return PTR_ERR(msgs);
+    }
+
+    for (i = 0; i < nr; i++) {
+        total += msgs[i].len;
+        msgs[i].copied = 0;
+    }
+    count = min3(total, (u64)READ_ONCE(queue_dev->capacity), (u64)STAGE_READ_MAX);
+
+    for (;;) {
+        engine = queue_lock(queue_dev, true);
+        framed = engine == SBER_ENGINE_LIST && queue_dev->framing == SBER_FRAMING_RECORD;
+        if (framed) {
+            ret = queue_record_read_batch(queue_dev, msgs, nr, &taken);
+        } else if (!stage) {
+            queue_unlock(queue_dev, engine, true);
+            stage = stage_alloc(onstack, count);
+            if (!stage) {
+                ret = -ENOMEM;
+                goto out;
+            }
+            continue;
+        } else {
+            ret = queue_read(queue_dev, engine, stage, count, &batch);
+        }
+        queue_unlock(queue_dev, engine, true);
+
+        if (ret || !count || !atomic_read(&queue_dev->writers)) {
+            break;
+        }
+        ret = queue_wait_data(queue_dev, file->f_flags & O_NONBLOCK);
+        if (ret) {
+            break;
         }
     }
+    chunk_batch_flush(&batch);
 
-    if (device_mode == MULTI_OPEN_MODE) {
-        queue_dev = kzalloc(sizeof(struct queue_device), GFP_KERNEL);
-        if (!queue_dev) {
-            return -ENOMEM;
+    if (ret > 0) {
+        wake_up_interruptible_poll(&queue_dev->write_wait, EPOLLOUT | EPOLLWRNORM);
+        done = framed ? queue_copy_records(msgs, &taken) : queue_copy_stage(msgs, nr, stage, ret);
+        for (i = 0, copied = 0; i < done; i++) {
+            copied += msgs[i].copied;
+        }
+        // Неразложенный остаток возвращается в очередь в исходном порядке.
+        if (framed && !list_empty(&taken)) {
+            if (queue_unread(queue_dev, &taken, NULL, 0)) {
+                pr_err_ratelimited("sber_device: Lost %zd records\n", ret - done);
+                list_for_each_entry_safe(record, next, &taken, list) {
+                    kvfree(record);
+                }
+            }
+        } else if (!framed && copied < (size_t)ret) {
+            if (queue_unread(queue_dev, NULL, stage + copied, ret - copied)) {
+                pr_err_ratelimited("sber_device: Lost %zu bytes\n", ret - copied);
+            }
         }
-        INIT_LIST_HEAD(&queue_dev->queue);
-        init_rwsem(&queue_dev->lock);
-        queue_dev->data_size = 0;
+        if (trace_sber_dequeue_enabled()) {
+            trace_sber_dequeue(queue_dev->id, copied, queue_occupancy(queue_dev));
+        }
+        ret = copied;
+
+        if (!done || copy_to_user(u64_to_user_ptr(hdr.msgs), msgs, done * sizeof(*msgs))) {
+            pr_err_ratelimited("sber_device: Failed to copy to user\n");
+            ret = -EFAULT;
+        }
+    }
+    // Запись возвращается в буфер целиком, поэтому коротким считается только поток байт.
+    queue_stat_read(queue_dev, ret, framed && ret > 0 ? ret : count);
+    if (ret > 0) {
+        ret = done;
+    }
+out:
+    stage_free(onstack, stage);
+    kfree(msgs);
+    return ret;
+}
+
+/**
+ * @brief Копирует данные из головы списка сегментов или первой записи, не извлекая их.
+ *
+ * @param queue_dev Указатель на очередь, вызывается под `queue_dev->lock` на чтение.
+ * @param data Буфер для скопированных данных.
+ * @param count Размер буфера.
+ * @param size Сюда записывается размер первой записи или количество байт потока.
+ *
+ * Копирование идет под head_lock не больше чем по сегменту (chunk_size байт) за захват,
+ * поэтому читатели не ждут долго на спин-блокировке, а писателей, которые работают под
+ * tail_lock, просмотр не задерживает вовсе. Пока данные не извлечены, читатель не освобождает
+ * сегменты и записи, а писатель не меняет уже записанное. Если между захватами читатель
+ * извлек данные, скопированное остается началом очереди на момент копирования, и просмотр
+ * на этом заканчивается.
+ *
+ * @return Количество скопированных байт.
+ */
+static size_t queue_list_peek(struct queue_device *queue_dev, char *data, size_t count, u32 *size) {
+    struct queue_record *record = NULL;
+    struct queue_chunk *chunk = NULL;
+    size_t copied = 0, pos = 0;
+    struct list_head *first;
+    size_t tail, len, out;
+
+    spin_lock(&queue_dev->head_lock);
+    out = queue_dev->bytes_out;
+    if (queue_dev->framing == SBER_FRAMING_RECORD) {
+        first = smp_load_acquire(&queue_dev->records.next);
+        record = first == &queue_dev->records ? NULL : list_entry(first, struct queue_record, list);
+        *size = record ? record->len : 0;
     } else {
-        queue_dev = &default_queue;
+        first = smp_load_acquire(&queue_dev->queue.next);
+        chunk = first == &queue_dev->queue ? NULL : list_entry(first, struct queue_chunk, list);
+        pos = chunk ? chunk->head : 0;
+        *size = queue_list_len(queue_dev);
     }
 
-    file->private_data = queue_dev;
-    pr_info("sber_device: Device opened in mode %d\n", device_mode);
+    while (copied < count && (record || chunk)) {
+        if (record) {
+            len = min3(count - copied, record->len - copied, (size_t)chunk_size);
+            memcpy(data + copied, record->data + copied, len);
+            copied += len;
+            if (copied == record->len) {
+                break;
+            }
+        } else {
+            first = smp_load_acquire(&chunk->list.next);
+            tail = smp_load_acquire(&chunk->tail);
+            len = min(count - copied, tail - pos);
+            memcpy(data + copied, chunk->data + pos, len);
+            copied += len;
+            pos += len;
+            if (pos == tail) {
+                if (first == &queue_dev->queue) {
+                    break;
+                }
+                chunk = list_entry(first, struct queue_chunk, list);
+                pos = chunk->head;
+            }
+        }
 
-    return 0;
+        spin_unlock(&queue_dev->head_lock);
+        cond_resched();
+        spin_lock(&queue_dev->head_lock);
+        if (queue_dev->bytes_out != out) {
+            break;
+        }
+    }
+    spin_unlock(&queue_dev->head_lock);
+    return copied;
 }
 
 /**
- * @brief Освобождает ресурсы при закрытии устройства.
+ * @brief Копирует данные из головы очереди, не извлекая их (SBER_IOC_PEEK).
  *
- * @param inode Указатель на структуру inode.
  * @param file Указатель на структуру файла, ассоциированную с устройством.
+ * @param umsg Буфер пользователя в виде struct sber_msg.
  *
- * Освобождает все элементы очереди, принадлежащие процессу, а также снимает
- * блокировку в режиме одиночного доступа. Если используется параллельный режим,
- * освобождает очередь, выделенную для конкретного процесса.
+ * При разбиении на записи копируется начало первой записи, а в copied сообщается ее
+ * полный размер, поэтому вызов с нулевой длиной позволяет подобрать буфер до чтения.
+ * Для потока байт в copied сообщается количество байт в очереди. Пустая очередь не ожидается.
+ * У шардов нет общей головы, а голову очереди без блокировок могут занять параллельно,
+ * поэтому для этих механизмов команда недоступна.
  *
- * @return 0 при успешном освобождении устройства.
+ * @return Количество скопированных байт, -ENODEV для шардов и очереди без блокировок или код ошибки.
  */
-static int device_release(struct inode *inode, struct file *file) {
-    struct queue_device *queue_dev = file->private_data;
-    struct queue_element *elem, *tmp;
+static long queue_peek(struct file *file, struct sber_msg __user *umsg) {
+    struct queue_device *queue_dev = queue_of(file);
+    char onstack[STAGE_ONSTACK];
+    struct sber_msg msg;
+    size_t count;
+    char *stage;
+    ssize_t ret;
+    int engine;
 
-    if (device_mode == SINGLE_OPEN_MODE) {
-        mutex_unlock(&single_open_lock);
+    if (copy_from_user(&msg, umsg, sizeof(msg))) {
+        return -EFAULT;
     }
 
-    down_write(&queue_dev->lock);
-    list_for_each_entry_safe(elem, tmp, &queue_dev->queue, list) {
-        list_del(&elem->list);
-        kfree(elem);
+    count = min3((size_t)msg.len, READ_ONCE(queue_dev->capacity), (size_t)STAGE_READ_MAX);
+    stage = stage_alloc(onstack, count);
+    if (!stage) {
+        return -ENOMEM;
     }
-    up_write(&queue_dev->lock);
 
-    if (device_mode == MULTI_OPEN_MODE) {
-        kfree(queue_dev);
+    engine = queue_lock(queue_dev, true);
+    if (engine == SBER_ENGINE_RING) {
+        msg.copied = kfifo_len(&queue_dev->ring);
+        ret = kfifo_out_peek(&queue_dev->ring, stage, count);
+    } else if (queue_engine_lockless(engine)) {
+        ret = -ENODEV;
+    } else {
+        ret = queue_list_peek(queue_dev, stage, count, &msg.copied);
     }
+    queue_unlock(queue_dev, engine, true);
 
-    pr_info("sber_device: Device closed\n");
-    return 0;
+    if (ret >= 0 && ((ret && copy_to_user(u64_to_user_ptr(msg.buf), stage, ret)) ||
+                     copy_to_user(umsg, &msg, sizeof(msg)))) {
+        pr_err_ratelimited("sber_device: Failed to copy to user\n");
+        ret = -EFAULT;
+    }
+    stage_free(onstack, stage);
+    return ret;
 }
 
 /**
- * @brief Записывает данные в очередь устройства.
+ * @brief Извлекает данные до подтверждения (SBER_IOC_READ_PENDING).
  *
  * @param file Указатель на структуру файла, ассоциированную с устройством.
- * @param buf Указатель на буфер пользователя для записи.
- * @param count Количество байт для записи.
- * @param offset Смещение, игнорируется в этом драйвере.
+ * @param upending Запрос в пространстве пользователя.
  *
- * Копирует данные из пользовательского буфера в очередь устройства.
- * Если данные не помещаются в очередь (ограничение QUEUE_SIZE), возвращает ошибку переполнения.
- * Использует `copy_from_user` для безопасного доступа к памяти пользователя.
+ * Извлекает одну запись целиком (или -EMSGSIZE) либо до len байт потока, как read,
+ * и ждет данных так же, как read. Извлеченные данные остаются в списке pending очереди,
+ * пока их не подтвердят через SBER_IOC_ACK; при закрытии дескриптора они возвращаются
+ * в голову очереди. Если данные не удалось скопировать пользователю, они возвращаются
+ * в очередь сразу. Двухфазное чтение доступно только для списка сегментов.
  *
- * @return Количество записанных байт или -ENOSPC в случае переполнения.
+ * @return Количество извлеченных байт, 0 без писателей или код ошибки.
  */
-static ssize_t device_write(struct file *file, const char __user *buf, size_t count, loff_t *offset) {
-    struct queue_device *queue_dev = file->private_data;
-    struct queue_element *elem;
-    size_t i;
-    int ret = 0;
+static long queue_read_pending(struct file *file, struct sber_pending __user *upending) {
+    struct queue_device *queue_dev = queue_of(file);
+    struct chunk_batch batch = { .nr = 0 };
+    struct queue_record *record = NULL;
+    struct queue_record *buf = NULL;
+    struct sber_pending req;
+    size_t count;
+    ssize_t ret;
 
-    if (count + queue_dev->data_size > QUEUE_SIZE) {
-        pr_warn("sber_device: Queue overflow\n");
-        return -ENOSPC;
+    if (copy_from_user(&req, upending, sizeof(req))) {
+        return -EFAULT;
+    }
+    if (!req.len) {
+        return -EINVAL;
     }
+    count = min3((size_t)req.len, READ_ONCE(queue_dev->capacity), (size_t)STAGE_READ_MAX);
 
-    down_write(&queue_dev->lock);
-    for (i = 0; i < count; i++) {
-        elem = kmalloc(sizeof(struct queue_element), GFP_KERNEL);
-        if (!elem) {
-            pr_err("sber_device: Memory allocation failed\n");
-            ret = -ENOMEM;
-            break;
+    for (;;) {
+        down_write(&queue_dev->lock);
+        if (queue_dev->engine != SBER_ENGINE_LIST) {
+            ret = -ENODEV;
+        } else if (queue_dev->framing == SBER_FRAMING_RECORD) {
+            ret = queue_record_read(queue_dev, req.len, &record);
+        } else if (!buf) {
+            up_write(&queue_dev->lock);
+            buf = queue_record_alloc(count, queue_alloc_node(queue_dev));
+            if (!buf) {
+                return -ENOMEM;
+            }
+            continue;
+        } else {
+            ret = queue_list_read(queue_dev, buf->data, count, &batch);
+            if (ret) {
+                buf->len = ret;
+                swap(record, buf);
+            }
         }
+        if (ret > 0) {
+            record->owner = file;
+            record->token = 0;
+            queue_record_charge(queue_dev, record);
+            list_add_tail(&record->list, &queue_dev->pending);
+        }
+        up_write(&queue_dev->lock);
 
-        if (copy_from_user(&elem->data, buf + i, 1)) {
-            pr_err("sber_device: Failed to copy from user\n");
-            kfree(elem);
-            ret = -EFAULT;
+        if (ret || !atomic_read(&queue_dev->writers)) {
             break;
         }
+        ret = queue_wait_data(queue_dev, file->f_flags & O_NONBLOCK);
+        if (ret) {
+            break;
+        }
+    }
+    chunk_batch_flush(&batch);
+    kvfree(buf);
+    queue_stat_read(queue_dev, ret, READ_ONCE(queue_dev->framing) == SBER_FRAMING_RECORD && ret > 0 ? ret : count);
+
+    if (ret <= 0) {
+        return ret;
+    }
 
-        list_add_tail(&elem->list, &queue_dev->queue);
-        queue_dev->data_size++;
+    wake_up_interruptible_poll(&queue_dev->write_wait, EPOLLOUT | EPOLLWRNORM);
+    if (trace_sber_dequeue_enabled()) {
+        trace_sber_dequeue(queue_dev->id, ret, queue_occupancy(queue_dev));
+    }
+    // Без идентификатора запись нельзя подтвердить, поэтому до выдачи token ее не освободит никто, кроме нас.
+    if (copy_to_user(u64_to_user_ptr(req.buf), record->data, ret)) {
+        pr_err_ratelimited("sber_device: Failed to copy to user\n");
+        down_write(&queue_dev->lock);
+        list_del(&record->list);
+        queue_requeue(queue_dev, record, &batch);
+        up_write(&queue_dev->lock);
+        chunk_batch_flush(&batch);
+        wake_up_interruptible_poll(&queue_dev->read_wait, EPOLLIN | EPOLLRDNORM);
+        return -EFAULT;
     }
+
+    down_write(&queue_dev->lock);
+    record->token = ++queue_dev->next_token;
+    req.token = record->token;
     up_write(&queue_dev->lock);
 
-    pr_info("sber_device: Wrote %zu bytes\n", i);
-    return ret ? ret : i;
+    req.copied = ret;
+    if (copy_to_user(upending, &req, sizeof(req))) {
+        return -EFAULT;
+    }
+    return ret;
 }
 
 /**
- * @brief Читает данные из очереди устройства.
+ * @brief Подтверждает обработку данных, извлеченных SBER_IOC_READ_PENDING (SBER_IOC_ACK).
  *
  * @param file Указатель на структуру файла, ассоциированную с устройством.
- * @param buf Указатель на буфер пользователя для чтения.
- * @param count Количество байт для чтения.
- * @param offset Смещение, игнорируется в этом драйвере.
- *
- * Извлекает данные из очереди устройства и копирует их в буфер пользователя,
- * удаляя прочитанные элементы из очереди. Если данных недостаточно, возвращает
- * количество прочитанных байт. `copy_to_user` используется для безопасной передачи данных.
+ * @param token Идентификатор, выданный SBER_IOC_READ_PENDING через этот же дескриптор.
  *
- * @return Количество прочитанных байт или ошибку в случае неудачи.
+ * @return 0 при успехе или -ENOENT для неизвестного идентификатора.
  */
-static ssize_t device_read(struct file *file, char __user *buf, size_t count, loff_t *offset) {
-    struct queue_device *queue_dev = file->private_data;
-    struct queue_element *elem;
-    size_t i;
-    int ret = 0;
+static int queue_ack(struct file *file, u64 token) {
+    struct queue_device *queue_dev = queue_of(file);
+    struct queue_record *record;
+    bool found = false;
 
-    down_read(&queue_dev->lock);
-    for (i = 0; i < count && queue_dev->data_size > 0; i++) {
-        elem = list_first_entry(&queue_dev->queue, struct queue_element, list);
+    if (!token) {
+        return -ENOENT;
+    }
 
-        if (copy_to_user(buf + i, &elem->data, 1)) {
-            pr_err("sber_device: Failed to copy to user\n");
-            ret = -EFAULT;
+    down_write(&queue_dev->lock);
+    list_for_each_entry(record, &queue_dev->pending, list) {
+        if (record->token == token && record->owner == file) {
+            list_del(&record->list);
+            found = true;
             break;
         }
+    }
+    up_write(&queue_dev->lock);
 
-        list_del(&elem->list);
-        kfree(elem);
-        queue_dev->data_size--;
+    if (!found) {
+        return -ENOENT;
     }
-    up_read(&queue_dev->lock);
+    queue_record_free(queue_dev, record);
+    return 0;
+}
+
+/**
+ * @brief Задает размещение памяти очереди по узлам NUMA (SBER_IOC_SET_NUMA).
+ *
+ * @param queue_dev Указатель на очередь.
+ * @param unuma Размещение в пространстве пользователя; счетчики в нем игнорируются.
+ *
+ * Размещение действует на память, выделяемую после вызова; уже выделенная память,
+ * в том числе сегменты пула, не переносится. Пока из очереди не читали, размещение
+ * по узлу читателя выделяет память на узле писателя.
+ *
+ * @return 0 при успехе, -EINVAL для неизвестного размещения или узла без памяти.
+ */
+static int queue_set_numa(struct queue_device *queue_dev, struct sber_numa __user *unuma) {
+    struct sber_numa numa;
+
+    if (copy_from_user(&numa, unuma, sizeof(numa))) {
+        return -EFAULT;
+    }
+    if (numa.policy > SBER_NUMA_NODE) {
+        return -EINVAL;
+    }
+    if (numa.policy == SBER_NUMA_NODE &&
+        (numa.node < 0 || numa.node >= nr_node_ids || !node_online(numa.node))) {
+        return -EINVAL;
+    }
+
+    WRITE_ONCE(queue_dev->numa_node, numa.policy == SBER_NUMA_NODE ? numa.node : NUMA_NO_NODE);
+    WRITE_ONCE(queue_dev->numa_policy, numa.policy);
+    sber_info("sber_device: NUMA policy set to %u, node %d\n", numa.policy, queue_dev->numa_node);
+    return 0;
+}
+
+/**
+ * @brief Возвращает размещение памяти очереди и счетчики чтений по узлам (SBER_IOC_GET_NUMA).
+ *
+ * @param queue_dev Указатель на очередь.
+ * @param unuma Буфер пользователя.
+ *
+ * @return 0 при успехе или -EFAULT.
+ */
+static int queue_get_numa(struct queue_device *queue_dev, struct sber_numa __user *unuma) {
+    struct sber_numa numa = {
+        .policy = READ_ONCE(queue_dev->numa_policy),
+        .node = READ_ONCE(queue_dev->numa_node),
+        .hits = atomic_long_read(&queue_dev->numa_hits),
+        .misses = atomic_long_read(&queue_dev->numa_misses),
+    };
 
-    pr_info("sber_device: Read %zu bytes\n", i);
-    return ret ? ret : i;
+    return copy_to_user(unuma, &numa, sizeof(numa)) ? -EFAULT : 0;
 }
 
 /**
- * @brief Устанавливает режим работы устройства.
+ * @brief Подключает дескриптор параллельного режима к именованной очереди (SBER_IOC_ATTACH).
  *
  * @param file Указатель на структуру файла, ассоциированную с устройством.
- * @param cmd Команда, задающая режим работы (0 - общий, 1 - одиночный, 2 - параллельный).
- * @param arg Дополнительный аргумент (игнорируется).
+ * @param uattach Имя очереди в пространстве пользователя.
  *
- * Устанавливает режим работы `device_mode`, который определяет поведение устройства
- * при открытии и доступе: общий доступ, одиночный или параллельный.
+ * Очередь ищется по хешу имени и создается при первом подключении. Дескриптор подключается
+ * один раз, и только пока его собственная очередь пуста; она остается у дескриптора до закрытия,
+ * и операции, начатые до подключения, завершаются на ней. Дескриптор, который уже ждал в poll,
+ * select или epoll, не подключается: ожидание, в том числе регистрация epoll, осталось бы
+ * на собственной очереди и не видело бы данных именованной. Вызов poll, параллельный
+ * подключению, тем же способом не отслеживается, поэтому подключать дескриптор следует
+ * до того, как его передают в epoll.
  *
- * @return 0 при успешной установке режима или -EINVAL в случае неправильной команды.
+ * @return 0 при успехе, -EINVAL вне параллельного режима или для недопустимого имени,
+ * -EBUSY для уже подключенного или ожидавшего в poll дескриптора либо непустой собственной
+ * очереди, -ENOMEM.
  */
-static long device_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+static int queue_attach(struct file *file, struct sber_attach __user *uattach) {
+    struct queue_file *qfile = file->private_data;
+    struct sber_attach attach;
+    struct named_queue *named;
+
+    if (qfile->mode != MULTI_OPEN_MODE) {
+        return -EINVAL;
+    }
+    if (copy_from_user(&attach, uattach, sizeof(attach))) {
+        return -EFAULT;
+    }
+    if (!attach.name[0] || strnlen(attach.name, sizeof(attach.name)) == sizeof(attach.name)) {
+        return -EINVAL;
+    }
+    if (READ_ONCE(qfile->named) || READ_ONCE(qfile->polled) || queue_len(qfile->own) ||
+        !list_empty(&qfile->own->pending) || atomic_read(&qfile->own->mmap_count)) {
+        return -EBUSY;
+    }
+
+    named = named_queue_get(attach.name);
+    if (!named) {
+        return -ENOMEM;
+    }
+    if (cmpxchg(&qfile->named, NULL, named)) {
+        named_queue_put(named);
+        return -EBUSY;
+    }
+
+    if (file->f_mode & FMODE_READ) {
+        atomic_inc(&named->queue.readers);
+    }
+    if (file->f_mode & FMODE_WRITE) {
+        atomic_inc(&named->queue.writers);
+    }
+    WRITE_ONCE(qfile->queue, &named->queue);
+
+    sber_info("sber_device: Attached to queue %s\n", named->name);
+    return 0;
+}
+
+/**
+ * @brief Устанавливает режим работы устройства и управляет резервом очереди.
+ *
+ * @param file Указатель на структуру файла, ассоциированную с устройством.
+ * @param cmd Команда, задающая режим работы (0 - общий, 1 - одиночный, 2 - параллельный),
+ * либо одна из команд SBER_IOC_* из sber_driver.h.
+ * @param arg Аргумент команды SBER_IOC_* (для команд режима игнорируется).
+ *
+ * Устанавливает режим работы `mode` экземпляра устройства, который определяет его поведение
+ * при открытии и доступе: общий доступ, одиночный или параллельный. Режимы разных
+ * экземпляров /dev/sber_devN независимы.
+ * SBER_IOC_RESERVE резервирует сегменты очереди под указанное число байт,
+ * SBER_IOC_UNRESERVE снимает резерв, SBER_IOC_SET_ENGINE выбирает механизм хранения очереди,
+ * SBER_IOC_SET_CAPACITY и SBER_IOC_GET_CAPACITY задают и возвращают емкость очереди дескриптора,
+ * SBER_IOC_GET_WINDOW и SBER_IOC_CONSUME служат потребителю, отобразившему кольцо в память,
+ * SBER_IOC_SET_FRAMING включает и выключает разбиение очереди на записи,
+ * SBER_IOC_ENQUEUE_BATCH и SBER_IOC_DEQUEUE_BATCH передают пакет сообщений за один вызов,
+ * SBER_IOC_PEEK копирует голову очереди без извлечения, SBER_IOC_READ_PENDING и SBER_IOC_ACK
+ * извлекают данные в две фазы, SBER_IOC_ATTACH подключает дескриптор к именованной очереди,
+ * SBER_IOC_GET_MEMORY возвращает объем памяти, занятой очередью дескриптора,
+ * SBER_IOC_SET_POOL_CACHE задает кэш свободных сегментов, который при нехватке памяти забирает shrinker,
+ * SBER_IOC_SET_NUMA и SBER_IOC_GET_NUMA задают размещение памяти очереди по узлам NUMA
+ * и возвращают его вместе со счетчиками чтений из своего и чужого узла, SBER_IOC_SET_RING_PAGES
+ * выбирает обычные или большие страницы для кольцевого буфера, SBER_IOC_GET_STATS возвращает
+ * статистику очереди дескриптора.
+ *
+ * @return 0 при успешном выполнении команды или код ошибки (-EINVAL в случае неправильной команды).
+ */
+static long queue_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+    struct queue_minor *minor = queue_minor_of(file_inode(file));
+    struct queue_device *queue_dev = queue_of(file);
+    u32 engine;
+    struct sber_stats stats;
+    int mode, old;
+    u32 framing;
+    u32 pages;
+    u64 token;
+    u64 bytes;
+
     switch (cmd) {
     case 0:
-        device_mode = DEFAULT_MODE;
+        mode = DEFAULT_MODE;
         break;
     case 1:
-        device_mode = SINGLE_OPEN_MODE;
+        mode = SINGLE_OPEN_MODE;
         break;
     case 2:
-        device_mode = MULTI_OPEN_MODE;
+        mode = MULTI_OPEN_MODE;
         break;
+    case SBER_IOC_RESERVE:
+        if (get_user(bytes, (u64 __user *)arg)) {
+            return -EFAULT;
+        }
+        return queue_reserve(queue_dev, bytes);
+    case SBER_IOC_UNRESERVE:
+        return queue_reserve(queue_dev, 0);
+    case SBER_IOC_SET_ENGINE:
+        if (get_user(engine, (u32 __user *)arg)) {
+            return -EFAULT;
+        }
+        return queue_set_engine(queue_dev, engine);
+    case SBER_IOC_SET_CAPACITY:
+        if (get_user(bytes, (u64 __user *)arg)) {
+            return -EFAULT;
+        }
+        return queue_set_capacity(queue_dev, bytes);
+    case SBER_IOC_GET_CAPACITY:
+        bytes = READ_ONCE(queue_dev->capacity);
+        return put_user(bytes, (u64 __user *)arg);
+    case SBER_IOC_GET_WINDOW:
+        return queue_get_window(queue_dev, (struct sber_window __user *)arg);
+    case SBER_IOC_CONSUME:
+        if (get_user(bytes, (u64 __user *)arg)) {
+            return -EFAULT;
+        }
+        return queue_consume(queue_dev, bytes);
+    case SBER_IOC_SET_FRAMING:
+        if (get_user(framing, (u32 __user *)arg)) {
+            return -EFAULT;
+        }
+        return queue_set_framing(queue_dev, framing);
+    case SBER_IOC_ENQUEUE_BATCH:
+        return queue_enqueue_batch(file, (struct sber_batch __user *)arg);
+    case SBER_IOC_DEQUEUE_BATCH:
+        return queue_dequeue_batch(file, (struct sber_batch __user *)arg);
+    case SBER_IOC_PEEK:
+        return queue_peek(file, (struct sber_msg __user *)arg);
+    case SBER_IOC_READ_PENDING:
+        return queue_read_pending(file, (struct sber_pending __user *)arg);
+    case SBER_IOC_ACK:
+        if (get_user(token, (u64 __user *)arg)) {
+            return -EFAULT;
+        }
+        return queue_ack(file, token);
+    case SBER_IOC_ATTACH:
+        return queue_attach(file, (struct sber_attach __user *)arg);
+    case SBER_IOC_GET_MEMORY:
+        bytes = queue_memory(queue_dev);
+        return put_user(bytes, (u64 __user *)arg);
+    case SBER_IOC_SET_POOL_CACHE:
+        if (get_user(bytes, (u64 __user *)arg)) {
+            return -EFAULT;
+        }
+        return queue_set_pool_cache(queue_dev, bytes);
+    case SBER_IOC_SET_NUMA:
+        return queue_set_numa(queue_dev, (struct sber_numa __user *)arg);
+    case SBER_IOC_GET_NUMA:
+        return queue_get_numa(queue_dev, (struct sber_numa __user *)arg);
+    case SBER_IOC_SET_RING_PAGES:
+        if (get_user(pages, (u32 __user *)arg)) {
+            return -EFAULT;
+        }
+        return queue_set_ring_pages(queue_dev, pages);
+    case SBER_IOC_GET_STATS:
+        queue_stats_sum(queue_dev, &stats);
+        return copy_to_user((struct sber_stats __user *)arg, &stats, sizeof(stats)) ? -EFAULT : 0;
     default:
         return -EINVAL;
     }
 
-    pr_info("sber_device: Mode set to %d\n", device_mode);
+    old = xchg(&minor->mode, mode);
+    trace_sber_mode_change(minor - minors, old, mode);
+    sber_info("sber_device: Mode set to %d\n", mode);
     return 0;
 }
 
+/**
+ * @brief Выполняет команду ioctl и учитывает ее отказы в статистике очереди дескриптора.
+ *
+ * @param file Указатель на структуру файла, ассоциированную с устройством.
+ * @param cmd Команда.
+ * @param arg Аргумент команды.
+ *
+ * @return Результат queue_ioctl.
+ */
+static long device_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+    long ret = queue_ioctl(file, cmd, arg);
+
+    queue_stat_error(queue_of(file), ret);
+    return ret;
+}
+
 static const struct file_operations fops = {
     .owner = THIS_MODULE,
     .open = device_open,
     .release = device_release,
-    .write = device_write,
-    .read = device_read,
+    .write_iter = device_write_iter,
+    .read_iter = device_read_iter,
+    .splice_write = iter_file_splice_write,
+    .splice_read = copy_splice_read,
     .unlocked_ioctl = device_ioctl,
+    .mmap = device_mmap,
+    .get_unmapped_area = thp_get_unmapped_area,
+    .poll = device_poll,
+};
+
+// Сериализует записи в /sys/class/sber_dev/capacity, чтобы откат одной не смешался с другой.
+static DEFINE_MUTEX(capacity_lock);
+
+static ssize_t capacity_show(const struct class *class, const struct class_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%lu\n", READ_ONCE(queue_capacity));
+}
+
+/**
+ * @brief Задает емкость общих очередей и очередей, создаваемых в параллельном режиме.
+ *
+ * Запись в /sys/class/sber_dev/capacity сразу применяется к общим очередям всех
+ * экземпляров устройства; уже открытые параллельные очереди сохраняют свою емкость.
+ * Емкость отдельной очереди задается через SBER_IOC_SET_CAPACITY.
+ * Новая емкость применяется ко всем общим очередям или ни к одной: если очередь отказала
+ * (-EBUSY для непустого кольца или -ENOMEM), уже измененные очереди получают прежнюю емкость.
+ * Возврат не может отказать: кольцо при уменьшении емкости не перевыделяется.
+ */
+static ssize_t capacity_store(const struct class *class, const struct class_attribute *attr,
+                              const char *buf, size_t count) {
+    unsigned long bytes;
+    size_t *old;
+    unsigned int i;
+    int ret;
+
+    ret = kstrtoul(buf, 0, &bytes);
+    if (ret) {
+        return ret;
+    }
+    if (!bytes || bytes > QUEUE_MAX_CAPACITY) {
+        return -EINVAL;
+    }
+
+    old = kmalloc_array(nr_devices, sizeof(*old), GFP_KERNEL);
+    if (!old) {
+        return -ENOMEM;
+    }
+    mutex_lock(&capacity_lock);
+    for (i = 0; i < nr_devices; i++) {
+        old[i] = READ_ONCE(minors[i].queue.capacity);
+        ret = queue_set_capacity(&minors[i].queue, bytes);
+        if (ret) {
+            while (i--) {
+                queue_set_capacity(&minors[i].queue, old[i]);
+            }
+            break;
+        }
+    }
+    mutex_unlock(&capacity_lock);
+    kfree(old);
+    if (ret) {
+        return ret;
+    }
+
+    WRITE_ONCE(queue_capacity, bytes);
+    return count;
+}
+static CLASS_ATTR_RW(capacity);
+
+static ssize_t chunk_size_show(const struct class *class, const struct class_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%u\n", chunk_size);
+}
+static CLASS_ATTR_RO(chunk_size);
+
+static ssize_t verbosity_show(const struct class *class, const struct class_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%d\n", READ_ONCE(verbosity));
+}
+
+static ssize_t verbosity_store(const struct class *class, const struct class_attribute *attr,
+                               const char *buf, size_t count) {
+    int level;
+    int ret;
+
+    ret = kstrtoint(buf, 0, &level);
+    if (ret) {
+        return ret;
+    }
+
+    WRITE_ONCE(verbosity, level);
+    return count;
+}
+static CLASS_ATTR_RW(verbosity);
+
+// Атрибуты класса sber_dev в /sys/class/sber_dev/.
+static const struct class_attribute *queue_class_attrs[] = {
+    &class_attr_capacity,
+    &class_attr_chunk_size,
+    &class_attr_verbosity,
 };
 
+/**
+ * @brief Создает атрибуты класса sber_dev.
+ *
+ * @return 0 при успехе или код ошибки; при ошибке уже созданные атрибуты удаляются.
+ */
+static int queue_class_add_attrs(void) {
+    int i;
+    int ret;
+
+    for (i = 0; i < ARRAY_SIZE(queue_class_attrs); i++) {
+        ret = class_create_file(queue_class, queue_class_attrs[i]);
+        if (ret) {
+            while (--i >= 0) {
+                class_remove_file(queue_class, queue_class_attrs[i]);
+            }
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Удаляет атрибуты класса sber_dev.
+ */
+static void queue_class_remove_attrs(void) {
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(queue_class_attrs); i++) {
+        class_remove_file(queue_class, queue_class_attrs[i]);
+    }
+}
+
+/**
+ * @brief Удаляет объекты первых nr экземпляров устройства и освобождает их общие очереди.
+ *
+ * @param nr Количество созданных экземпляров.
+ */
+static void queue_destroy_devices(unsigned int nr) {
+    unsigned int i;
+
+    for (i = 0; i < nr; i++) {
+        device_destroy(queue_class, MKDEV(MAJOR(first), MINOR(first) + i));
+        queue_teardown(&minors[i].queue);
+    }
+}
+
+/**
+ * @brief Создает объекты устройства для всех экземпляров.
+ *
+ * Единственный экземпляр называется sber_dev, как и прежде, а при nr_devices > 1
+ * экземпляры называются sber_dev0..sber_devN-1.
+ *
+ * @return 0 при успехе или код ошибки; при ошибке уже созданные объекты удаляются.
+ */
+static int queue_create_devices(void) {
+    struct device *dev;
+    unsigned int i;
+
+    for (i = 0; i < nr_devices; i++) {
+        if (queue_dev_init(&minors[i].queue)) {
+            queue_destroy_devices(i);
+            return -ENOMEM;
+        }
+        minors[i].mode = DEFAULT_MODE;
+        minors[i].flags = 0;
+
+        if (nr_devices == 1) {
+            dev = device_create(queue_class, NULL, first, NULL, DEVICE_NAME);
+        } else {
+            dev = device_create(queue_class, NULL, MKDEV(MAJOR(first), MINOR(first) + i), NULL,
+                                DEVICE_NAME "%u", i);
+        }
+        if (IS_ERR(dev)) {
+            queue_teardown(&minors[i].queue);
+            queue_destroy_devices(i);
+            return PTR_ERR(dev);
+        }
+        queue_register(&minors[i].queue);
+        queue_debugfs_add(&minors[i].queue, dev_name(dev), queue_debugfs);
+    }
+    return 0;
+}
+
 /**
  * @brief Инициализирует устройство, регистрирует его в ядре.
  *
  * Регистрирует драйвер символического устройства с автоматическим назначением
- * major-номера, создает класс и объект устройства, инициализирует общую очередь
- * `default_queue` для работы в общем режиме.
+ * major-номера и nr_devices minor-номеров, создает класс, кэш сегментов `chunk_cache`
+ * и объекты экземпляров устройства, у каждого из которых своя общая очередь,
+ * свой режим работы и своя блокировка.
  *
  * @return 0 при успешной регистрации устройства или код ошибки.
  */
 static int __init queue_init(void) {
-    if (alloc_chrdev_region(&first, 0, 1, DEVICE_NAME) < 0) {
+    int ret;
+
+    if (!chunk_size) {
+        chunk_size = CHUNK_DEFAULT_SIZE;
+    }
+    if (chunk_size < CHUNK_MIN_SIZE || chunk_size > CHUNK_MAX_SIZE) {
+        pr_err("sber_device: chunk_size must be between %d and %d\n", CHUNK_MIN_SIZE, CHUNK_MAX_SIZE);
+        return -EINVAL;
+    }
+    if (!queue_capacity || queue_capacity > QUEUE_MAX_CAPACITY) {
+        pr_err("sber_device: queue_capacity must be between 1 and %d\n", QUEUE_MAX_CAPACITY);
+        return -EINVAL;
+    }
+    if (!nr_devices || nr_devices > MAX_DEVICES) {
+        pr_err("sber_device: nr_devices must be between 1 and %d\n", MAX_DEVICES);
+        return -EINVAL;
+    }
+
+    chunk_cache = kmem_cache_create("sber_queue_chunk", sizeof(struct queue_chunk) + chunk_size, 0, SLAB_ACCOUNT, NULL);
+    if (!chunk_cache) {
+        pr_err("sber_device: Failed to create chunk cache\n");
+        return -ENOMEM;
+    }
+
+    queue_shrinker = shrinker_alloc(0, DEVICE_NAME);
+    if (!queue_shrinker) {
+        pr_err("sber_device: Failed to allocate shrinker\n");
+        ret = -ENOMEM;
+        goto err_cache;
+    }
+    queue_shrinker->count_objects = queue_shrink_count;
+    queue_shrinker->scan_objects = queue_shrink_scan;
+    shrinker_register(queue_shrinker);
+
+    minors = kcalloc(nr_devices, sizeof(*minors), GFP_KERNEL);
+    if (!minors) {
+        ret = -ENOMEM;
+        goto err_shrinker;
+    }
+
+    ret = alloc_chrdev_region(&first, 0, nr_devices, DEVICE_NAME);
+    if (ret < 0) {
         pr_err("sber_device: Failed to register device\n");
-        return -1;
+        goto err_minors;
     }
 
     queue_class = class_create(DEVICE_NAME);
     if (IS_ERR(queue_class)) {
-        unregister_chrdev_region(first, 1);
         pr_err("sber_device: Failed to create class\n");
-        return PTR_ERR(queue_class);
+        ret = PTR_ERR(queue_class);
+        goto err_region;
+    }
+
+    ret = queue_class_add_attrs();
+    if (ret) {
+        pr_err("sber_device: Failed to create class attributes\n");
+        goto err_class;
     }
 
-    if (!device_create(queue_class, NULL, first, NULL, DEVICE_NAME)) {
-        class_destroy(queue_class);
-        unregister_chrdev_region(first, 1);
+    queue_debugfs = debugfs_create_dir(DEVICE_NAME, NULL);
+    named_debugfs = debugfs_create_dir("named", queue_debugfs);
+    ret = queue_create_devices();
+    if (ret) {
         pr_err("sber_device: Failed to create device\n");
-        return -ENOMEM;
+        goto err_debugfs;
     }
 
     cdev_init(&c_dev, &fops);
-    if (cdev_add(&c_dev, first, 1) == -1){
-          device_destroy(queue_class, first);
-          class_destroy(queue_class);
-          unregister_chrdev_region(first, 1);
+    ret = cdev_add(&c_dev, first, nr_devices);
+    if (ret) {
+        pr_err("sber_device: Failed to add cdev\n");
+        goto err_device;
     }
 
-    INIT_LIST_HEAD(&default_queue.queue);
-    init_rwsem(&default_queue.lock);
-    default_queue.data_size = 0;
-
-    pr_info("sber_device: Registered with major number %d\n", MAJOR(first));
+    pr_info("sber_device: Registered %u devices with major number %d\n", nr_devices, MAJOR(first));
     return 0;
+
+err_device:
+    queue_destroy_devices(nr_devices);
+err_debugfs:
+    debugfs_remove(queue_debugfs);
+    queue_class_remove_attrs();
+err_class:
+    class_destroy(queue_class);
+err_region:
+    unregister_chrdev_region(first, nr_devices);
+err_minors:
+    kfree(minors);
+err_shrinker:
+    shrinker_free(queue_shrinker);
+err_cache:
+    kmem_cache_destroy(chunk_cache);
+    return ret;
 }
 
 /**
@@ -295,9 +4279,14 @@ static int __init queue_init(void) {
  */
 static void __exit queue_exit(void) {
     cdev_del(&c_dev);
-    device_destroy(queue_class, first);
+    shrinker_free(queue_shrinker);
+    queue_destroy_devices(nr_devices);
+    debugfs_remove(queue_debugfs);
+    queue_class_remove_attrs();
     class_destroy(queue_class);
-    unregister_chrdev_region(first, 1);
+    unregister_chrdev_region(first, nr_devices);
+    kfree(minors);
+    kmem_cache_destroy(chunk_cache);
     pr_info("sber_device: Unregistered\n");
 }
 
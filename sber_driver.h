@@ -0,0 +1,164 @@
+/**
+ * @file sber_driver.h
+ * @brief Команды ioctl драйвера sber_dev, общие для модуля и пользовательских утилит.
+ *
+ * Команды выбора режима (0 - общий, 1 - одиночный, 2 - параллельный) передаются
+ * числами без кодирования и здесь не описаны.
+ */
+#ifndef SBER_DRIVER_H
+#define SBER_DRIVER_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define SBER_IOC_MAGIC 's'
+
+// Резервирует в пуле очереди сегменты под указанное количество байт (аргумент - __u64).
+#define SBER_IOC_RESERVE _IOW(SBER_IOC_MAGIC, 1, __u64)
+// Снимает резерв и освобождает свободные сегменты пула очереди.
+#define SBER_IOC_UNRESERVE _IO(SBER_IOC_MAGIC, 2)
+// Выбирает механизм хранения пустой очереди (аргумент - __u32, одно из SBER_ENGINE_*).
+#define SBER_IOC_SET_ENGINE _IOW(SBER_IOC_MAGIC, 3, __u32)
+// Задает емкость очереди в байтах (аргумент - __u64).
+#define SBER_IOC_SET_CAPACITY _IOW(SBER_IOC_MAGIC, 4, __u64)
+// Возвращает емкость очереди в байтах (аргумент - __u64).
+#define SBER_IOC_GET_CAPACITY _IOR(SBER_IOC_MAGIC, 5, __u64)
+// Возвращает границы данных кольцевого буфера, отображенного через mmap (аргумент - struct sber_window).
+#define SBER_IOC_GET_WINDOW _IOR(SBER_IOC_MAGIC, 6, struct sber_window)
+// Удаляет из головы кольцевого буфера обработанные на месте байты (аргумент - __u64).
+#define SBER_IOC_CONSUME _IOW(SBER_IOC_MAGIC, 7, __u64)
+// Выбирает разбиение пустой очереди на записи (аргумент - __u32, одно из SBER_FRAMING_*).
+#define SBER_IOC_SET_FRAMING _IOW(SBER_IOC_MAGIC, 8, __u32)
+// Ставит в очередь пакет сообщений за один вызов (аргумент - struct sber_batch).
+// Возвращает количество поставленных сообщений, как sendmmsg.
+#define SBER_IOC_ENQUEUE_BATCH _IOW(SBER_IOC_MAGIC, 9, struct sber_batch)
+// Извлекает из очереди пакет сообщений за один вызов (аргумент - struct sber_batch) и заполняет
+// поле copied каждого описания. Возвращает количество извлеченных сообщений, как recvmmsg.
+#define SBER_IOC_DEQUEUE_BATCH _IOW(SBER_IOC_MAGIC, 10, struct sber_batch)
+// Копирует данные из головы очереди, не извлекая их (аргумент - struct sber_msg). Возвращает
+// количество скопированных байт, а в copied записывает размер первой записи или всего потока.
+#define SBER_IOC_PEEK _IOWR(SBER_IOC_MAGIC, 11, struct sber_msg)
+// Извлекает данные до подтверждения (аргумент - struct sber_pending). Неподтвержденные данные
+// возвращаются в голову очереди при закрытии дескриптора.
+#define SBER_IOC_READ_PENDING _IOWR(SBER_IOC_MAGIC, 12, struct sber_pending)
+// Подтверждает обработку данных, извлеченных SBER_IOC_READ_PENDING (аргумент - __u64, token).
+#define SBER_IOC_ACK _IOW(SBER_IOC_MAGIC, 13, __u64)
+// Подключает дескриптор, открытый в параллельном режиме, к именованной очереди (аргумент -
+// struct sber_attach). Очередь создается при первом подключении и удаляется с последним дескриптором.
+// Дескриптор подключают до poll, select и epoll: после них команда возвращает -EBUSY.
+#define SBER_IOC_ATTACH _IOW(SBER_IOC_MAGIC, 14, struct sber_attach)
+// Возвращает объем памяти ядра, занятой очередью, в байтах вместе с заголовками и пулом (аргумент - __u64).
+#define SBER_IOC_GET_MEMORY _IOR(SBER_IOC_MAGIC, 15, __u64)
+// Задает, сколько байт свободных сегментов очередь держит в пуле сверх резерва после опустошения
+// (аргумент - __u64). В отличие от резерва, этот кэш освобождается при нехватке памяти.
+#define SBER_IOC_SET_POOL_CACHE _IOW(SBER_IOC_MAGIC, 16, __u64)
+// Задает размещение памяти очереди по узлам NUMA (аргумент - struct sber_numa, поля policy и node).
+#define SBER_IOC_SET_NUMA _IOW(SBER_IOC_MAGIC, 17, struct sber_numa)
+// Возвращает размещение и счетчики чтений из памяти своего и чужого узла (аргумент - struct sber_numa).
+#define SBER_IOC_GET_NUMA _IOR(SBER_IOC_MAGIC, 18, struct sber_numa)
+// Выбирает страницы, из которых выделяется кольцевой буфер (аргумент - __u32, одно из SBER_RING_PAGES_*).
+// Для очереди с механизмом SBER_ENGINE_RING кольцо перевыделяется, поэтому она должна быть пустой.
+#define SBER_IOC_SET_RING_PAGES _IOW(SBER_IOC_MAGIC, 19, __u32)
+// Возвращает статистику очереди, собранную со всех процессоров без захвата блокировок (аргумент -
+// struct sber_stats). Та же статистика доступна в /sys/kernel/debug/sber_dev/<очередь>/stats,
+// а для именованных очередей - в /sys/kernel/debug/sber_dev/named/<имя>/stats.
+#define SBER_IOC_GET_STATS _IOR(SBER_IOC_MAGIC, 20, struct sber_stats)
+
+// Максимальное количество сообщений, обрабатываемое одной пакетной командой; лишние игнорируются.
+#define SBER_BATCH_MAX 1024
+
+// Размер буфера имени очереди вместе с завершающим нулем.
+#define SBER_QUEUE_NAME_MAX 32
+
+// Список сегментов на struct list_head.
+#define SBER_ENGINE_LIST 0
+// Кольцевой буфер kfifo: один писатель и один читатель работают без общей блокировки.
+#define SBER_ENGINE_RING 1
+// Шарды по процессорам: писатели пишут в шард своего процессора, читатели забирают данные
+// сначала из своего шарда, затем из чужих. Порядок данных между шардами не сохраняется.
+#define SBER_ENGINE_SHARD 2
+// Очередь Майкла-Скотта без блокировок: писатели и читатели продвигают хвост и голову через cmpxchg.
+#define SBER_ENGINE_LOCKFREE 3
+
+// Память выделяется на узле писателя.
+#define SBER_NUMA_PRODUCER 0
+// Память выделяется на узле, где последний раз читали из очереди.
+#define SBER_NUMA_CONSUMER 1
+// Память выделяется на узле node.
+#define SBER_NUMA_NODE 2
+
+// Кольцо из обычных страниц по 4 КБ.
+#define SBER_RING_PAGES_SMALL 0
+// Кольцо из больших страниц по 2 МБ: размер кольца не меньше 2 МБ, а отображение через mmap
+// использует большие страницы, если они включены в системе (transparent hugepages).
+#define SBER_RING_PAGES_HUGE 1
+
+// Поток байт: границы вызовов write не сохраняются.
+#define SBER_FRAMING_STREAM 0
+// Записи: каждый вызов write добавляет одну запись, каждый вызов read возвращает одну запись целиком.
+#define SBER_FRAMING_RECORD 1
+
+// Окно данных кольцевого буфера размером size: len байт начиная со смещения head.
+// Если данные переходят через конец буфера, tail меньше head и данные продолжаются с нулевого смещения.
+struct sber_window {
+    __u64 head;
+    __u64 tail;
+    __u64 len;
+    __u64 size;
+};
+
+// Описание сообщения пакетной команды: буфер buf длиной len. Команда извлечения
+// записывает в copied количество байт, помещенных в буфер.
+struct sber_msg {
+    __u64 buf;
+    __u32 len;
+    __u32 copied;
+};
+
+// Пакетная команда: msgs - адрес массива из vlen описаний struct sber_msg.
+struct sber_batch {
+    __u64 msgs;
+    __u32 vlen;
+    __u32 reserved;
+};
+
+// Двухфазное чтение: буфер buf длиной len. Драйвер записывает в copied количество
+// полученных байт, а в token - идентификатор для SBER_IOC_ACK.
+struct sber_pending {
+    __u64 buf;
+    __u32 len;
+    __u32 copied;
+    __u64 token;
+};
+
+// Имя именованной очереди: непустая строка, завершенная нулем в пределах буфера.
+struct sber_attach {
+    char name[SBER_QUEUE_NAME_MAX];
+};
+
+// Размещение памяти очереди: policy - одно из SBER_NUMA_*, node - узел для SBER_NUMA_NODE.
+// hits и misses считают объекты хранилища, прочитанные из памяти узла читателя и чужого узла.
+struct sber_numa {
+    __u32 policy;
+    __s32 node;
+    __u64 hits;
+    __u64 misses;
+};
+
+// Статистика очереди с момента ее создания: записанные и прочитанные байты, вызовы записи и чтения
+// (включая пакетные и двухфазные), чтения, вернувшие меньше запрошенного (в том числе из пустой
+// очереди), отказы записи из-за нехватки места (-ENOSPC и -EAGAIN), отказы -EBUSY, ошибки выделения
+// памяти и наибольшее заполнение очереди в байтах, замеченное после записи.
+struct sber_stats {
+    __u64 bytes_in;
+    __u64 bytes_out;
+    __u64 writes;
+    __u64 reads;
+    __u64 short_reads;
+    __u64 overflows;
+    __u64 busy;
+    __u64 alloc_failures;
+    __u64 high_water;
+};
+
+#endif /* SBER_DRIVER_H */
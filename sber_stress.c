@@ -0,0 +1,244 @@
+/**
+ * @file sber_stress.c
+ * @brief Нагрузочная проверка очереди sber_dev: доставка ровно один раз и порядок записей.
+ *
+ * Несколько писателей и несколько читателей одновременно работают с одним дескриптором.
+ * Каждый писатель записывает заданное количество записей по 16 байт {номер писателя,
+ * порядковый номер}, по одной записи за вызов write. Читатели читают буферами, кратными
+ * размеру записи, и проверяют, что:
+ * - ни один вызов read не вернул часть записи;
+ * - каждая запись получена ровно один раз (без потерь и повторов);
+ * - каждый читатель получает записи одного писателя в порядке возрастания номеров
+ *   (кроме механизма шардов, который порядок не сохраняет).
+ *
+ * Очередь дескриптора должна быть пустой, чтобы драйвер разрешил сменить механизм
+ * хранения; удобнее всего запускать утилиту в параллельном режиме (ioctl 2).
+ *
+ * Сборка: make stress
+ * Запуск: ./sber_stress [устройство] [list|ring|shard|lockfree] [писатели] [читатели] [записей_на_писателя]
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sber_driver.h"
+
+#define DEFAULT_DEVICE "/dev/sber_dev"
+#define DEFAULT_PRODUCERS 4
+#define DEFAULT_CONSUMERS 4
+#define DEFAULT_RECORDS 100000
+// Сколько секунд ждать оставшиеся записи после завершения писателей.
+#define DRAIN_TIMEOUT 10
+#define READ_RECORDS 64
+
+// Запись, которую передают писатели.
+struct record {
+    uint64_t producer;
+    uint64_t seq;
+};
+
+static int fd;
+static unsigned int nr_producers = DEFAULT_PRODUCERS;
+static unsigned int nr_consumers = DEFAULT_CONSUMERS;
+static uint64_t nr_records = DEFAULT_RECORDS;
+static int check_order = 1;
+
+// Сколько раз получена каждая запись: seen[producer * nr_records + seq].
+static unsigned char *seen;
+static uint64_t consumed;
+static uint64_t duplicates;
+static uint64_t reordered;
+static uint64_t torn;
+static int stop;
+
+static double now_sec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *producer_thread(void *arg) {
+    struct record rec = { .producer = (uintptr_t)arg };
+    ssize_t ret;
+
+    for (rec.seq = 0; rec.seq < nr_records; rec.seq++) {
+        for (;;) {
+            ret = write(fd, &rec, sizeof(rec));
+            if (ret == sizeof(rec)) {
+                break;
+            }
+            if (ret < 0 && (errno == EAGAIN || errno == ENOSPC)) {
+                sched_yield();
+                continue;
+            }
+            perror("write");
+            return (void *)1;
+        }
+    }
+    return NULL;
+}
+
+static void *consumer_thread(void *arg) {
+    struct record buf[READ_RECORDS];
+    uint64_t *next_seq;
+    uint64_t total = (uint64_t)nr_producers * nr_records;
+    ssize_t ret;
+    size_t i, n;
+
+    // Минимальный номер, который этот читатель может получить от каждого писателя.
+    next_seq = calloc(nr_producers, sizeof(*next_seq));
+    if (!next_seq) {
+        return (void *)1;
+    }
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED) && __atomic_load_n(&consumed, __ATOMIC_RELAXED) < total) {
+        ret = read(fd, buf, sizeof(buf));
+        if (ret < 0 && errno != EAGAIN) {
+            perror("read");
+            free(next_seq);
+            return (void *)1;
+        }
+        if (ret <= 0) {
+            sched_yield();
+            continue;
+        }
+        if (ret % sizeof(struct record)) {
+            __atomic_fetch_add(&torn, 1, __ATOMIC_RELAXED);
+        }
+
+        n = ret / sizeof(struct record);
+        for (i = 0; i < n; i++) {
+            if (buf[i].producer >= nr_producers || buf[i].seq >= nr_records) {
+                __atomic_fetch_add(&torn, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            if (__atomic_fetch_add(&seen[buf[i].producer * nr_records + buf[i].seq], 1, __ATOMIC_RELAXED)) {
+                __atomic_fetch_add(&duplicates, 1, __ATOMIC_RELAXED);
+            }
+            if (check_order && buf[i].seq < next_seq[buf[i].producer]) {
+                __atomic_fetch_add(&reordered, 1, __ATOMIC_RELAXED);
+            }
+            next_seq[buf[i].producer] = buf[i].seq + 1;
+        }
+        __atomic_fetch_add(&consumed, n, __ATOMIC_RELAXED);
+    }
+
+    free(next_seq);
+    return NULL;
+}
+
+static int parse_engine(const char *name, __u32 *engine) {
+    static const struct {
+        const char *name;
+        __u32 engine;
+    } engines[] = {
+        { "list", SBER_ENGINE_LIST },
+        { "ring", SBER_ENGINE_RING },
+        { "shard", SBER_ENGINE_SHARD },
+        { "lockfree", SBER_ENGINE_LOCKFREE },
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+        if (!strcmp(name, engines[i].name)) {
+            *engine = engines[i].engine;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    const char *device = argc > 1 ? argv[1] : DEFAULT_DEVICE;
+    const char *engine_name = argc > 2 ? argv[2] : "lockfree";
+    pthread_t *producers, *consumers;
+    uint64_t total, missing = 0, i;
+    double start, elapsed, deadline;
+    void *tret;
+    int failed = 0;
+    __u32 engine;
+
+    if (argc > 3) {
+        nr_producers = strtoul(argv[3], NULL, 0);
+    }
+    if (argc > 4) {
+        nr_consumers = strtoul(argv[4], NULL, 0);
+    }
+    if (argc > 5) {
+        nr_records = strtoull(argv[5], NULL, 0);
+    }
+    if (parse_engine(engine_name, &engine) || !nr_producers || !nr_consumers || !nr_records) {
+        fprintf(stderr, "usage: %s [device] [list|ring|shard|lockfree] [producers] [consumers] [records]\n", argv[0]);
+        return 2;
+    }
+    check_order = engine != SBER_ENGINE_SHARD;
+
+    total = (uint64_t)nr_producers * nr_records;
+    seen = calloc(total, 1);
+    producers = calloc(nr_producers, sizeof(*producers));
+    consumers = calloc(nr_consumers, sizeof(*consumers));
+    if (!seen || !producers || !consumers) {
+        perror("calloc");
+        return 1;
+    }
+
+    fd = open(device, O_RDWR | O_NONBLOCK);
+    if (fd < 0) {
+        perror(device);
+        return 1;
+    }
+    if (ioctl(fd, SBER_IOC_SET_ENGINE, &engine)) {
+        perror("SBER_IOC_SET_ENGINE");
+        return 1;
+    }
+
+    start = now_sec();
+    for (i = 0; i < nr_consumers; i++) {
+        pthread_create(&consumers[i], NULL, consumer_thread, NULL);
+    }
+    for (i = 0; i < nr_producers; i++) {
+        pthread_create(&producers[i], NULL, producer_thread, (void *)(uintptr_t)i);
+    }
+    for (i = 0; i < nr_producers; i++) {
+        pthread_join(producers[i], &tret);
+        failed |= tret != NULL;
+    }
+
+    // Потерянные записи не дали бы читателям завершиться, поэтому ожидание ограничено.
+    deadline = now_sec() + DRAIN_TIMEOUT;
+    while (__atomic_load_n(&consumed, __ATOMIC_RELAXED) < total && now_sec() < deadline) {
+        usleep(10000);
+    }
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < nr_consumers; i++) {
+        pthread_join(consumers[i], &tret);
+        failed |= tret != NULL;
+    }
+    elapsed = now_sec() - start;
+
+    for (i = 0; i < total; i++) {
+        missing += !seen[i];
+    }
+
+    printf("%-8s %2u producers %2u consumers  %10.0f records/s\n", engine_name, nr_producers, nr_consumers,
+           consumed / elapsed);
+    printf("missing %llu, duplicates %llu, reordered %llu, torn %llu\n", (unsigned long long)missing,
+           (unsigned long long)duplicates, (unsigned long long)reordered, (unsigned long long)torn);
+
+    close(fd);
+    if (failed || missing || duplicates || reordered || torn) {
+        printf("FAILED\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,258 @@
+/**
+ * @file sber_test.c
+ * @brief Функциональные проверки команд ioctl очереди sber_dev.
+ *
+ * Каждая проверка открывает свои дескрипторы и печатает "OK" или "FAILED" с причиной:
+ * - peek: SBER_IOC_PEEK копирует голову потока, не извлекая ее;
+ * - pending: SBER_IOC_READ_PENDING извлекает данные до подтверждения, SBER_IOC_ACK подтверждает;
+ * - redelivery: неподтвержденные данные возвращаются в очередь при закрытии дескриптора;
+ * - records: границы записей сохраняются, а запись больше буфера дает -EMSGSIZE;
+ * - batch: SBER_IOC_DEQUEUE_BATCH с недоступным буфером возвращает количество заполненных
+ *   буферов, а остальные записи остаются в очереди по порядку;
+ * - named: два дескриптора, подключенные к одному имени, видят одни данные, очередь
+ *   удаляется с последним дескриптором, а дескриптор, ожидавший в poll, не подключается.
+ *
+ * Каждый дескриптор должен получать собственную пустую очередь, поэтому утилиту запускают
+ * в параллельном режиме (ioctl 2).
+ *
+ * Сборка: make sber_test (make test собирает утилиту и запускает test_sber_driver.sh)
+ * Запуск: ./sber_test [устройство]
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "sber_driver.h"
+
+#define DEFAULT_DEVICE "/dev/sber_dev"
+
+static const char *device = DEFAULT_DEVICE;
+
+// Завершает проверку с причиной what, если условие cond не выполнено.
+#define CHECK(cond, what)                                           \
+    do {                                                            \
+        if (!(cond)) {                                              \
+            printf("FAILED (%s: %s)\n", what, strerror(errno));     \
+            goto out;                                               \
+        }                                                           \
+    } while (0)
+
+static int open_queue(void) {
+    int fd = open(device, O_RDWR | O_NONBLOCK);
+
+    if (fd < 0) {
+        perror(device);
+    }
+    return fd;
+}
+
+static int attach(int fd, const char *name) {
+    struct sber_attach req;
+
+    memset(&req, 0, sizeof(req));
+    strncpy(req.name, name, sizeof(req.name) - 1);
+    return ioctl(fd, SBER_IOC_ATTACH, &req);
+}
+
+static int set_framing(int fd, __u32 framing) {
+    return ioctl(fd, SBER_IOC_SET_FRAMING, &framing);
+}
+
+static int test_peek(void) {
+    struct sber_msg msg;
+    char buf[32];
+    int failed = 1;
+    int fd;
+
+    printf("peek: ");
+    fd = open_queue();
+    CHECK(fd >= 0, "open");
+    CHECK(write(fd, "hello world", 11) == 11, "write");
+
+    msg.buf = (uintptr_t)buf;
+    msg.len = 5;
+    msg.copied = 0;
+    CHECK(ioctl(fd, SBER_IOC_PEEK, &msg) == 5, "peek");
+    CHECK(msg.copied == 11 && !memcmp(buf, "hello", 5), "peek data");
+
+    // Просмотр не извлекает данные: read возвращает весь поток.
+    CHECK(read(fd, buf, sizeof(buf)) == 11 && !memcmp(buf, "hello world", 11), "read after peek");
+    printf("OK\n");
+    failed = 0;
+out:
+    close(fd);
+    return failed;
+}
+
+static int test_pending(void) {
+    struct sber_pending req;
+    char buf[32];
+    int failed = 1;
+    __u64 token;
+    int fd;
+
+    printf("pending: ");
+    fd = open_queue();
+    CHECK(fd >= 0, "open");
+    CHECK(write(fd, "abc", 3) == 3, "write");
+
+    req.buf = (uintptr_t)buf;
+    req.len = sizeof(buf);
+    CHECK(ioctl(fd, SBER_IOC_READ_PENDING, &req) == 3, "read pending");
+    CHECK(req.copied == 3 && req.token && !memcmp(buf, "abc", 3), "pending data");
+    CHECK(read(fd, buf, sizeof(buf)) < 0 && errno == EAGAIN, "queue empty while pending");
+
+    token = req.token;
+    CHECK(ioctl(fd, SBER_IOC_ACK, &token) == 0, "ack");
+    CHECK(ioctl(fd, SBER_IOC_ACK, &token) < 0 && errno == ENOENT, "second ack");
+    printf("OK\n");
+    failed = 0;
+out:
+    close(fd);
+    return failed;
+}
+
+static int test_redelivery(void) {
+    struct sber_pending req;
+    int fd1 = -1, fd2 = -1;
+    char buf[32];
+    int failed = 1;
+
+    printf("redelivery: ");
+    fd1 = open_queue();
+    fd2 = open_queue();
+    CHECK(fd1 >= 0 && fd2 >= 0, "open");
+    CHECK(!attach(fd1, "sber_test_redelivery") && !attach(fd2, "sber_test_redelivery"), "attach");
+    CHECK(write(fd1, "xyz", 3) == 3, "write");
+
+    req.buf = (uintptr_t)buf;
+    req.len = sizeof(buf);
+    CHECK(ioctl(fd2, SBER_IOC_READ_PENDING, &req) == 3, "read pending");
+    close(fd2);
+    fd2 = -1;
+
+    // Данные, не подтвержденные закрытым дескриптором, снова в голове очереди.
+    CHECK(read(fd1, buf, sizeof(buf)) == 3 && !memcmp(buf, "xyz", 3), "read redelivered");
+    printf("OK\n");
+    failed = 0;
+out:
+    close(fd1);
+    close(fd2);
+    return failed;
+}
+
+static int test_records(void) {
+    char buf[32];
+    int failed = 1;
+    int fd;
+
+    printf("records: ");
+    fd = open_queue();
+    CHECK(fd >= 0, "open");
+    CHECK(!set_framing(fd, SBER_FRAMING_RECORD), "set framing");
+    CHECK(write(fd, "one", 3) == 3 && write(fd, "three", 5) == 5, "write");
+
+    CHECK(read(fd, buf, 2) < 0 && errno == EMSGSIZE, "short buffer");
+    CHECK(read(fd, buf, sizeof(buf)) == 3 && !memcmp(buf, "one", 3), "first record");
+    CHECK(read(fd, buf, sizeof(buf)) == 5 && !memcmp(buf, "three", 5), "second record");
+    printf("OK\n");
+    failed = 0;
+out:
+    close(fd);
+    return failed;
+}
+
+static int test_batch(void) {
+    struct sber_msg msgs[3];
+    struct sber_batch batch;
+    char bufs[3][16];
+    int failed = 1;
+    int fd, i;
+
+    printf("batch: ");
+    fd = open_queue();
+    CHECK(fd >= 0, "open");
+    CHECK(!set_framing(fd, SBER_FRAMING_RECORD), "set framing");
+    CHECK(write(fd, "r0", 2) == 2 && write(fd, "r1", 2) == 2 && write(fd, "r2", 2) == 2, "write");
+
+    for (i = 0; i < 3; i++) {
+        msgs[i].buf = (uintptr_t)bufs[i];
+        msgs[i].len = sizeof(bufs[i]);
+        msgs[i].copied = 0;
+    }
+    // Второй буфер недоступен: вызов сообщает об одном буфере, как recvmmsg.
+    msgs[1].buf = 1;
+    batch.msgs = (uintptr_t)msgs;
+    batch.vlen = 3;
+    batch.reserved = 0;
+    CHECK(ioctl(fd, SBER_IOC_DEQUEUE_BATCH, &batch) == 1, "partial batch");
+    CHECK(msgs[0].copied == 2 && !memcmp(bufs[0], "r0", 2), "first buffer");
+
+    CHECK(read(fd, bufs[1], sizeof(bufs[1])) == 2 && !memcmp(bufs[1], "r1", 2), "requeued record");
+    CHECK(read(fd, bufs[2], sizeof(bufs[2])) == 2 && !memcmp(bufs[2], "r2", 2), "record order");
+    printf("OK\n");
+    failed = 0;
+out:
+    close(fd);
+    return failed;
+}
+
+static int test_named(void) {
+    int fd1 = -1, fd2 = -1, fd3 = -1;
+    struct pollfd pfd;
+    char buf[32];
+    int failed = 1;
+
+    printf("named: ");
+    fd1 = open_queue();
+    fd2 = open_queue();
+    CHECK(fd1 >= 0 && fd2 >= 0, "open");
+    CHECK(!attach(fd1, "sber_test_named") && !attach(fd2, "sber_test_named"), "attach");
+    CHECK(write(fd1, "shared", 6) == 6, "write");
+    CHECK(read(fd2, buf, sizeof(buf)) == 6 && !memcmp(buf, "shared", 6), "read from second fd");
+
+    // С последним дескриптором очередь удаляется вместе с непрочитанными данными.
+    CHECK(write(fd1, "left", 4) == 4, "write before close");
+    close(fd1);
+    close(fd2);
+    fd1 = fd2 = -1;
+    fd3 = open_queue();
+    CHECK(fd3 >= 0 && !attach(fd3, "sber_test_named"), "reattach");
+    CHECK(read(fd3, buf, sizeof(buf)) < 0 && errno == EAGAIN, "queue recreated empty");
+
+    // Ожидание в poll осталось бы на собственной очереди, поэтому подключение отклоняется.
+    fd1 = open_queue();
+    CHECK(fd1 >= 0, "open");
+    pfd.fd = fd1;
+    pfd.events = POLLIN;
+    CHECK(poll(&pfd, 1, 0) == 0, "poll");
+    CHECK(attach(fd1, "sber_test_named") < 0 && errno == EBUSY, "attach after poll");
+    printf("OK\n");
+    failed = 0;
+out:
+    close(fd1);
+    close(fd2);
+    close(fd3);
+    return failed;
+}
+
+int main(int argc, char **argv) {
+    int failed = 0;
+
+    if (argc > 1) {
+        device = argv[1];
+    }
+
+    failed |= test_peek();
+    failed |= test_pending();
+    failed |= test_redelivery();
+    failed |= test_records();
+    failed |= test_batch();
+    failed |= test_named();
+    return failed;
+}
@@ -0,0 +1,125 @@
+/**
+ * @file sber_trace.h
+ * @brief Точки трассировки драйвера sber_dev (подсистема sber в tracefs).
+ *
+ * События горячего пути записываются в кольцевой буфер трассировки только тогда, когда
+ * их включили, например: echo 1 > /sys/kernel/tracing/events/sber/enable, а выключенные
+ * стоят одну невыполняемую ветку. Очередь указывается номером queue, который совпадает
+ * с номером из имени собственной очереди параллельного режима в debugfs.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM sber
+
+#if !defined(SBER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define SBER_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/sched.h>
+
+// Передача данных: bytes байт записаны в очередь или извлечены из нее, после чего
+// в очереди осталось len байт.
+DECLARE_EVENT_CLASS(sber_transfer,
+    TP_PROTO(u32 queue, size_t bytes, size_t len),
+    TP_ARGS(queue, bytes, len),
+    TP_STRUCT__entry(
+        __field(u32, queue)
+        __field(size_t, bytes)
+        __field(size_t, len)
+        __field(pid_t, pid)
+    ),
+    TP_fast_assign(
+        __entry->queue = queue;
+        __entry->bytes = bytes;
+        __entry->len = len;
+        __entry->pid = current->pid;
+    ),
+    TP_printk("queue=%u bytes=%zu len=%zu pid=%d", __entry->queue, __entry->bytes, __entry->len, __entry->pid)
+);
+
+DEFINE_EVENT(sber_transfer, sber_enqueue,
+    TP_PROTO(u32 queue, size_t bytes, size_t len),
+    TP_ARGS(queue, bytes, len)
+);
+
+DEFINE_EVENT(sber_transfer, sber_dequeue,
+    TP_PROTO(u32 queue, size_t bytes, size_t len),
+    TP_ARGS(queue, bytes, len)
+);
+
+// Запись bytes байт отклонена или отложена: в очереди len байт при емкости capacity.
+TRACE_EVENT(sber_overflow,
+    TP_PROTO(u32 queue, size_t bytes, size_t len, size_t capacity),
+    TP_ARGS(queue, bytes, len, capacity),
+    TP_STRUCT__entry(
+        __field(u32, queue)
+        __field(size_t, bytes)
+        __field(size_t, len)
+        __field(size_t, capacity)
+        __field(pid_t, pid)
+    ),
+    TP_fast_assign(
+        __entry->queue = queue;
+        __entry->bytes = bytes;
+        __entry->len = len;
+        __entry->capacity = capacity;
+        __entry->pid = current->pid;
+    ),
+    TP_printk("queue=%u bytes=%zu len=%zu capacity=%zu pid=%d", __entry->queue, __entry->bytes, __entry->len,
+              __entry->capacity, __entry->pid)
+);
+
+// Открытие и закрытие дескриптора экземпляра minor в режиме mode, работающего с очередью queue.
+DECLARE_EVENT_CLASS(sber_file,
+    TP_PROTO(u32 queue, unsigned int minor, int mode),
+    TP_ARGS(queue, minor, mode),
+    TP_STRUCT__entry(
+        __field(u32, queue)
+        __field(unsigned int, minor)
+        __field(int, mode)
+        __field(pid_t, pid)
+    ),
+    TP_fast_assign(
+        __entry->queue = queue;
+        __entry->minor = minor;
+        __entry->mode = mode;
+        __entry->pid = current->pid;
+    ),
+    TP_printk("queue=%u minor=%u mode=%d pid=%d", __entry->queue, __entry->minor, __entry->mode, __entry->pid)
+);
+
+DEFINE_EVENT(sber_file, sber_open,
+    TP_PROTO(u32 queue, unsigned int minor, int mode),
+    TP_ARGS(queue, minor, mode)
+);
+
+DEFINE_EVENT(sber_file, sber_release,
+    TP_PROTO(u32 queue, unsigned int minor, int mode),
+    TP_ARGS(queue, minor, mode)
+);
+
+// Смена режима открытия экземпляра minor с old на mode.
+TRACE_EVENT(sber_mode_change,
+    TP_PROTO(unsigned int minor, int old, int mode),
+    TP_ARGS(minor, old, mode),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(int, old)
+        __field(int, mode)
+        __field(pid_t, pid)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->old = old;
+        __entry->mode = mode;
+        __entry->pid = current->pid;
+    ),
+    TP_printk("minor=%u old=%d mode=%d pid=%d", __entry->minor, __entry->old, __entry->mode, __entry->pid)
+);
+
+#endif /* SBER_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE sber_trace
+#include <trace/define_trace.h>
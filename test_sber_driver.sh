@@ -18,6 +18,8 @@ if [ $? -ne 0 ]; then
 else
     echo "Test 2 Failed"
 fi
+# Содержимое общей очереди сохраняется после закрытия, поэтому вычитываем записанные 1000 байт.
+cat $DEVICE > /dev/null
 
 echo "Running Test 3: Single Open Mode"
 sudo ioctl $DEVICE 1
@@ -46,3 +48,23 @@ if [ -z "$READ_DATA" ]; then
 else
     echo "Test 5 Failed"
 fi
+
+echo "Running Test 6: Capacity via sysfs"
+echo 2000 | sudo tee /sys/class/sber_dev/capacity > /dev/null
+dd if=/dev/zero of=$DEVICE bs=1500 count=1 2>/dev/null
+if [ $? -eq 0 ]; then
+    echo "Test 6 Passed"
+else
+    echo "Test 6 Failed"
+fi
+echo 1000 | sudo tee /sys/class/sber_dev/capacity > /dev/null
+
+echo "Running Test 7: Peek, pending/ack, records, batches and named queues"
+# Каждой проверке нужна своя пустая очередь, поэтому sber_test работает в параллельном режиме.
+sudo ioctl $DEVICE 2
+if [ -x ./sber_test ] && ./sber_test $DEVICE; then
+    echo "Test 7 Passed"
+else
+    echo "Test 7 Failed"
+fi
+sudo ioctl $DEVICE 0